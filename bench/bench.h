@@ -0,0 +1,20 @@
+#ifndef HPACK_BENCH_H
+#define HPACK_BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* keep the compiler from optimizing away a benchmarked result */
+static volatile uint64_t bench_sink;
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* minimal run time of each measurement */
+#define BENCH_MIN_NS	200000000
+
+#endif
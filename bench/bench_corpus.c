@@ -0,0 +1,474 @@
+/*
+ * End-to-end benchmark on header corpora.
+ *
+ * Input files are stories in the hpack-test-case format:
+ *
+ *   {"cases": [{"seqno": 0, "headers": [{"name": "value"}, ...]}, ...]}
+ *
+ * Each story is replayed on a fresh context, one case as one header block,
+ * through hpack_encode_header() and hpack_decode_header(), at several
+ * dynamic table sizes. Other keys, such as "wire", are ignored.
+ *
+ * Usage: bench_corpus story.json ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+#include "bench.h"
+
+struct bench_field {
+	char	*name;
+	char	*value;
+	int	name_len;
+	int	value_len;
+};
+
+struct bench_case {
+	struct bench_field	*fields;
+	int			count;
+
+	uint8_t			*wire;
+	int			wire_len;
+};
+
+struct bench_story {
+	const char		*filename;
+	struct bench_case	*cases;
+	int			count;
+};
+
+static const int bench_table_sizes[] = { 0, 256, 4096, 65536 };
+
+/* JSON parsing, only as much as the story format needs */
+
+static const char *json_start;
+static const char *json_pos;
+static const char *json_end;
+
+static void json_fail(const char *what)
+{
+	fprintf(stderr, "invalid story: %s at byte %d\n", what,
+			(int)(json_pos - json_start));
+	exit(1);
+}
+
+static void json_skip_space(void)
+{
+	while (json_pos < json_end && strchr(" \t\r\n", *json_pos) != NULL) {
+		json_pos++;
+	}
+}
+
+static bool json_accept(char c)
+{
+	json_skip_space();
+	if (json_pos < json_end && *json_pos == c) {
+		json_pos++;
+		return true;
+	}
+	return false;
+}
+
+static void json_expect(char c)
+{
+	if (!json_accept(c)) {
+		json_fail("unexpected character");
+	}
+}
+
+static int json_hex4(const char *p)
+{
+	int i, n = 0;
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+		n <<= 4;
+		if (c >= '0' && c <= '9') {
+			n |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			n |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			n |= c - 'A' + 10;
+		} else {
+			json_fail("invalid \\u escape");
+		}
+	}
+	return n;
+}
+
+/* return a malloc'ed unescaped string */
+static char *json_string(int *len_p)
+{
+	json_expect('"');
+
+	const char *p = json_pos;
+	while (p < json_end && *p != '"') {
+		p += (*p == '\\') ? 2 : 1;
+	}
+	if (p >= json_end) {
+		json_fail("unterminated string");
+	}
+
+	char *str = malloc(p - json_pos + 1);
+	char *out = str;
+	while (json_pos < p) {
+		char c = *json_pos++;
+		if (c != '\\') {
+			*out++ = c;
+			continue;
+		}
+		c = *json_pos++;
+		switch (c) {
+		case 'b': *out++ = '\b'; break;
+		case 'f': *out++ = '\f'; break;
+		case 'n': *out++ = '\n'; break;
+		case 'r': *out++ = '\r'; break;
+		case 't': *out++ = '\t'; break;
+		case 'u':
+			if (p - json_pos < 4) {
+				json_fail("short \\u escape");
+			}
+			int u = json_hex4(json_pos);
+			json_pos += 4;
+			if (u < 0x80) {
+				*out++ = u;
+			} else if (u < 0x800) {
+				*out++ = 0xC0 | (u >> 6);
+				*out++ = 0x80 | (u & 0x3F);
+			} else {
+				*out++ = 0xE0 | (u >> 12);
+				*out++ = 0x80 | ((u >> 6) & 0x3F);
+				*out++ = 0x80 | (u & 0x3F);
+			}
+			break;
+		default: *out++ = c; break;
+		}
+	}
+	json_pos = p + 1;
+
+	*out = '\0';
+	*len_p = out - str;
+	return str;
+}
+
+static void json_skip_value(void)
+{
+	int len;
+	json_skip_space();
+	if (json_pos >= json_end) {
+		json_fail("missing value");
+	}
+	switch (*json_pos) {
+	case '"':
+		free(json_string(&len));
+		return;
+	case '{':
+		json_pos++;
+		if (json_accept('}')) {
+			return;
+		}
+		do {
+			free(json_string(&len));
+			json_expect(':');
+			json_skip_value();
+		} while (json_accept(','));
+		json_expect('}');
+		return;
+	case '[':
+		json_pos++;
+		if (json_accept(']')) {
+			return;
+		}
+		do {
+			json_skip_value();
+		} while (json_accept(','));
+		json_expect(']');
+		return;
+	default: /* number, true, false, null */
+		while (json_pos < json_end && strchr(",}] \t\r\n", *json_pos) == NULL) {
+			json_pos++;
+		}
+	}
+}
+
+/* "headers": [{"name": "value"}, ...] */
+static void json_headers(struct bench_case *c)
+{
+	int size = 0;
+	json_expect('[');
+	if (json_accept(']')) {
+		return;
+	}
+	do {
+		json_expect('{');
+		if (json_accept('}')) {
+			continue;
+		}
+		do {
+			if (c->count == size) {
+				size = size ? size * 2 : 16;
+				c->fields = realloc(c->fields, sizeof(struct bench_field) * size);
+			}
+			struct bench_field *f = &c->fields[c->count++];
+			f->name = json_string(&f->name_len);
+			json_expect(':');
+			f->value = json_string(&f->value_len);
+		} while (json_accept(','));
+		json_expect('}');
+	} while (json_accept(','));
+	json_expect(']');
+}
+
+/* "cases": [{"headers": ...}, ...] */
+static void json_cases(struct bench_story *story)
+{
+	int size = 0;
+	json_expect('[');
+	if (json_accept(']')) {
+		return;
+	}
+	do {
+		if (story->count == size) {
+			size = size ? size * 2 : 64;
+			story->cases = realloc(story->cases, sizeof(struct bench_case) * size);
+		}
+		struct bench_case *c = &story->cases[story->count++];
+		memset(c, 0, sizeof(struct bench_case));
+
+		json_expect('{');
+		if (json_accept('}')) {
+			continue;
+		}
+		do {
+			int len;
+			char *key = json_string(&len);
+			json_expect(':');
+			if (strcmp(key, "headers") == 0) {
+				json_headers(c);
+			} else {
+				json_skip_value();
+			}
+			free(key);
+		} while (json_accept(','));
+		json_expect('}');
+	} while (json_accept(','));
+	json_expect(']');
+}
+
+static void bench_load_story(struct bench_story *story, const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror(filename);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *text = malloc(size);
+	if (fread(text, 1, size, fp) != size) {
+		perror(filename);
+		exit(1);
+	}
+	fclose(fp);
+
+	memset(story, 0, sizeof(struct bench_story));
+	story->filename = filename;
+
+	json_start = json_pos = text;
+	json_end = text + size;
+	json_expect('{');
+	do {
+		int len;
+		char *key = json_string(&len);
+		json_expect(':');
+		if (strcmp(key, "cases") == 0) {
+			json_cases(story);
+		} else {
+			json_skip_value();
+		}
+		free(key);
+	} while (json_accept(','));
+	json_expect('}');
+
+	free(text);
+}
+
+/* benchmark */
+
+struct bench_result {
+	uint64_t	fields;
+	uint64_t	raw_bytes;
+	uint64_t	coded_bytes;
+	uint64_t	encode_ns;
+	uint64_t	decode_ns;
+};
+
+/* encode the story once, and keep the wire of each case */
+static void bench_encode_pass(struct bench_story *story, int table_size,
+		bool keep, struct bench_result *result)
+{
+	static uint8_t buffer[256 * 1024];
+	hpack_t *hpack = hpack_new(table_size);
+	int i, j;
+	for (i = 0; i < story->count; i++) {
+		struct bench_case *c = &story->cases[i];
+		uint8_t *out = buffer;
+		for (j = 0; j < c->count; j++) {
+			struct bench_field *f = &c->fields[j];
+			int ret = hpack_encode_header(hpack, f->name, f->name_len,
+					f->value, f->value_len, out, buffer + sizeof(buffer));
+			if (ret < 0) {
+				fprintf(stderr, "%s: encode case %d: %s\n", story->filename,
+						i, hpack_strerror(ret));
+				exit(1);
+			}
+			out += ret;
+		}
+		if (keep) {
+			c->wire_len = out - buffer;
+			c->wire = malloc(c->wire_len);
+			memcpy(c->wire, buffer, c->wire_len);
+			result->fields += c->count;
+			result->coded_bytes += c->wire_len;
+			for (j = 0; j < c->count; j++) {
+				result->raw_bytes += c->fields[j].name_len + c->fields[j].value_len;
+			}
+		}
+		bench_sink += out - buffer;
+	}
+	hpack_free(hpack);
+}
+
+/* decode the story once, and check the result if @verify */
+static void bench_decode_pass(struct bench_story *story, int table_size,
+		bool verify)
+{
+	hpack_t *hpack = hpack_new(table_size);
+	int i;
+	for (i = 0; i < story->count; i++) {
+		struct bench_case *c = &story->cases[i];
+		const uint8_t *in = c->wire;
+		const uint8_t *end = c->wire + c->wire_len;
+		int j = 0;
+		while (in < end) {
+			const char *name_str, *value_str;
+			int name_len, value_len;
+			int ret = hpack_decode_header(hpack, in, end, &name_str,
+					&name_len, &value_str, &value_len);
+			if (ret < 0) {
+				fprintf(stderr, "%s: decode case %d: %s\n", story->filename,
+						i, hpack_strerror(ret));
+				exit(1);
+			}
+			in += ret;
+
+			if (verify) {
+				struct bench_field *f = j < c->count ? &c->fields[j] : NULL;
+				if (f == NULL || name_len != f->name_len
+						|| value_len != f->value_len
+						|| memcmp(value_str, f->value, value_len) != 0
+						|| strncasecmp(name_str, f->name, name_len) != 0) {
+					fprintf(stderr, "%s: decode case %d: mismatch at field %d\n",
+							story->filename, i, j);
+					exit(1);
+				}
+			}
+			bench_sink += value_len;
+			j++;
+		}
+		if (verify && j != c->count) {
+			fprintf(stderr, "%s: decode case %d: %d fields, expect %d\n",
+					story->filename, i, j, c->count);
+			exit(1);
+		}
+	}
+	hpack_free(hpack);
+}
+
+static void bench_story(struct bench_story *story, int table_size,
+		struct bench_result *result)
+{
+	int i, rounds;
+	uint64_t start;
+
+	memset(result, 0, sizeof(struct bench_result));
+	for (i = 0; i < story->count; i++) {
+		free(story->cases[i].wire);
+	}
+
+	/* warm up, record the wire, and check the round trip */
+	bench_encode_pass(story, table_size, true, result);
+	bench_decode_pass(story, table_size, true);
+
+	start = bench_now_ns();
+	for (rounds = 0; bench_now_ns() - start < BENCH_MIN_NS; rounds++) {
+		bench_encode_pass(story, table_size, false, NULL);
+	}
+	result->encode_ns = (bench_now_ns() - start) / rounds;
+
+	start = bench_now_ns();
+	for (rounds = 0; bench_now_ns() - start < BENCH_MIN_NS; rounds++) {
+		bench_decode_pass(story, table_size, false);
+	}
+	result->decode_ns = (bench_now_ns() - start) / rounds;
+}
+
+static void bench_print(const char *name, int table_size,
+		const struct bench_result *r)
+{
+	printf("%-24s %6d %8lu %8.1f %8.1f %8.1f %8.1f %6.3f\n",
+			name, table_size, (unsigned long)r->fields,
+			(double)r->encode_ns / r->fields,
+			(double)r->raw_bytes * 1000 / r->encode_ns,
+			(double)r->decode_ns / r->fields,
+			(double)r->raw_bytes * 1000 / r->decode_ns,
+			(double)r->coded_bytes / r->raw_bytes);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s story.json ...\n", argv[0]);
+		return 1;
+	}
+
+	int story_count = argc - 1;
+	struct bench_story *stories = calloc(story_count, sizeof(struct bench_story));
+	int i, j;
+	for (i = 0; i < story_count; i++) {
+		bench_load_story(&stories[i], argv[i + 1]);
+	}
+
+	/* MB/s is of raw name and value bytes; ratio is coded/raw bytes */
+	printf("%-24s %6s %8s %8s %8s %8s %8s %6s\n", "story", "table", "fields",
+			"enc-ns/f", "enc-MB/s", "dec-ns/f", "dec-MB/s", "ratio");
+
+	for (j = 0; j < sizeof(bench_table_sizes) / sizeof(int); j++) {
+		int table_size = bench_table_sizes[j];
+		struct bench_result total;
+		memset(&total, 0, sizeof(struct bench_result));
+
+		for (i = 0; i < story_count; i++) {
+			struct bench_result r;
+			bench_story(&stories[i], table_size, &r);
+
+			const char *name = strrchr(stories[i].filename, '/');
+			bench_print(name ? name + 1 : stories[i].filename, table_size, &r);
+
+			total.fields += r.fields;
+			total.raw_bytes += r.raw_bytes;
+			total.coded_bytes += r.coded_bytes;
+			total.encode_ns += r.encode_ns;
+			total.decode_ns += r.decode_ns;
+		}
+		if (story_count > 1) {
+			bench_print("(all)", table_size, &total);
+		}
+	}
+	return 0;
+}
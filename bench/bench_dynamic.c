@@ -0,0 +1,227 @@
+/*
+ * Microbenchmark of the dynamic table.
+ *
+ * Drive inserts, indexed lookups (hpack_dynamic_decode), encoder lookups
+ * (hpack_dynamic_encode) and size updates (hpack_max_size) at several
+ * table sizes, in scenarios:
+ *
+ *   steady: small entries, each insert evicts about one entry;
+ *   churn:  as steady, but every 32nd entry takes a third of the table,
+ *           so inserts evict entries in bursts;
+ *   shrink: fill the table, shrink it to 0 and restore it, repeatedly.
+ *
+ * Each operation is timed alone, and the mean and p99.9 are reported.
+ * The timer overhead, shown at the beginning, is included. Size updates
+ * are fewer than other operations, see the samples column.
+ *
+ * The same context is used for decoder and encoder lookups, so inserts
+ * include the upkeep of the encoder index.
+ *
+ * Usage: bench_dynamic
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack_static.h"
+#include "hpack_dynamic.h"
+#include "bench.h"
+
+#define BENCH_OPS		200000	/* inserts of each scenario */
+#define BENCH_ENTRIES		4096	/* distinct small entries */
+#define BENCH_CHURN_PERIOD	32
+
+static const int bench_table_sizes[] = { 4096, 16384, 65536, 262144, 1048576 };
+
+enum {
+	BENCH_OP_INSERT,
+	BENCH_OP_DECODE,
+	BENCH_OP_ENCODE,
+	BENCH_OP_SIZE_UPDATE,
+	BENCH_OP_MAX,
+};
+
+static const char *bench_op_names[BENCH_OP_MAX] = {
+	"insert", "decode", "encode", "size-update",
+};
+
+struct bench_entry {
+	const char	*name;
+	const char	*value;
+	int		name_len;
+	int		value_len;
+};
+
+static struct bench_entry bench_entries[BENCH_ENTRIES];
+
+/* the large values of churn point into here */
+static char bench_chars[1024 * 1024];
+
+struct bench_samples {
+	uint32_t	*ns;
+	int		count;
+};
+
+static struct bench_samples bench_samples[BENCH_OP_MAX];
+
+static void bench_init(void)
+{
+	static char names[BENCH_ENTRIES][16];
+	int i;
+
+	for (i = 0; i < sizeof(bench_chars); i++) {
+		bench_chars[i] = 'a' + rand() % 26;
+	}
+	for (i = 0; i < BENCH_ENTRIES; i++) {
+		struct bench_entry *e = &bench_entries[i];
+		e->name_len = sprintf(names[i], "x-bench-%d", i % 64);
+		e->name = names[i];
+		e->value_len = 10 + rand() % 50;
+		e->value = bench_chars + rand() % (sizeof(bench_chars) - 64);
+	}
+	for (i = 0; i < BENCH_OP_MAX; i++) {
+		bench_samples[i].ns = malloc(sizeof(uint32_t) * BENCH_OPS);
+	}
+}
+
+static inline void bench_record(int op, uint64_t start)
+{
+	struct bench_samples *s = &bench_samples[op];
+	if (s->count < BENCH_OPS) {
+		s->ns[s->count++] = bench_now_ns() - start;
+	}
+}
+
+static inline int bench_count(hpack_t *hpack)
+{
+	return hpack->insert_count - hpack->evict_count;
+}
+
+static void bench_insert(hpack_t *hpack, const struct bench_entry *e)
+{
+	uint64_t start = bench_now_ns();
+	int ret = hpack_dynamic_add(hpack, e->name, e->name_len,
+			e->value, e->value_len, HPACK_TOKEN_UNKNOWN);
+	bench_record(BENCH_OP_INSERT, start);
+	if (ret < 0) {
+		fprintf(stderr, "hpack_dynamic_add() fails: %s\n", hpack_strerror(ret));
+		exit(1);
+	}
+}
+
+/* look up a random live entry by decoder and encoder */
+static void bench_lookup(hpack_t *hpack)
+{
+	const char *name_str, *value_str;
+	int name_len, value_len, token, name_index;
+	int index = HPACK_STATIC_TABLE_SIZE + 1 + rand() % bench_count(hpack);
+
+	uint64_t start = bench_now_ns();
+	int ret = hpack_dynamic_decode(hpack, index, &name_str, &name_len,
+			&token, &value_str, &value_len);
+	bench_record(BENCH_OP_DECODE, start);
+	if (ret < 0) {
+		fprintf(stderr, "hpack_dynamic_decode() fails: %s\n", hpack_strerror(ret));
+		exit(1);
+	}
+
+	start = bench_now_ns();
+	bench_sink += hpack_dynamic_encode(hpack, name_str, name_len,
+			value_str, value_len, &name_index);
+	bench_record(BENCH_OP_ENCODE, start);
+}
+
+static void bench_size_update(hpack_t *hpack, int max_size)
+{
+	uint64_t start = bench_now_ns();
+	hpack_max_size(hpack, max_size);
+	bench_record(BENCH_OP_SIZE_UPDATE, start);
+}
+
+static void bench_scenario(int table_size, const char *scenario)
+{
+	hpack_t *hpack = hpack_new(table_size);
+	uint32_t i;
+
+	for (i = 0; i < BENCH_OP_MAX; i++) {
+		bench_samples[i].count = 0;
+	}
+
+	for (i = 0; bench_samples[BENCH_OP_INSERT].count < BENCH_OPS; i++) {
+		struct bench_entry e = bench_entries[i % BENCH_ENTRIES];
+
+		if (strcmp(scenario, "churn") == 0 && i % BENCH_CHURN_PERIOD == 0) {
+			e.value_len = table_size / 3;
+			e.value = bench_chars;
+		}
+		bench_insert(hpack, &e);
+
+		if (strcmp(scenario, "shrink") == 0) {
+			/* refill, and then shrink to zero */
+			if (hpack->buf_used + 128 > table_size) {
+				bench_size_update(hpack, 0);
+				bench_size_update(hpack, table_size);
+			}
+		} else if (i % 64 == 0) {
+			/* the same size, as a peer sending its settings again */
+			bench_size_update(hpack, table_size);
+		}
+
+		if (bench_count(hpack) > 0) {
+			bench_lookup(hpack);
+		}
+	}
+
+	hpack_free(hpack);
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(int table_size, const char *scenario)
+{
+	int op;
+	for (op = 0; op < BENCH_OP_MAX; op++) {
+		struct bench_samples *s = &bench_samples[op];
+		uint64_t sum = 0;
+		int i;
+		for (i = 0; i < s->count; i++) {
+			sum += s->ns[i];
+		}
+		qsort(s->ns, s->count, sizeof(uint32_t), bench_cmp);
+
+		printf("%7d %-7s %-12s %8d %8.1f %8u %8u\n", table_size, scenario,
+				bench_op_names[op], s->count, (double)sum / s->count,
+				s->ns[s->count * 999 / 1000], s->ns[s->count - 1]);
+	}
+}
+
+int main(void)
+{
+	static const char *scenarios[] = { "steady", "churn", "shrink" };
+	int i, j;
+
+	bench_init();
+
+	/* time nothing */
+	for (i = 0; i < BENCH_OPS; i++) {
+		bench_record(BENCH_OP_INSERT, bench_now_ns());
+	}
+	qsort(bench_samples[0].ns, BENCH_OPS, sizeof(uint32_t), bench_cmp);
+	printf("timer overhead: %u ns median\n", bench_samples[0].ns[BENCH_OPS / 2]);
+
+	printf("%7s %-7s %-12s %8s %8s %8s %8s\n", "table", "case", "op",
+			"samples", "mean-ns", "p99.9-ns", "max-ns");
+
+	for (i = 0; i < sizeof(bench_table_sizes) / sizeof(int); i++) {
+		for (j = 0; j < sizeof(scenarios) / sizeof(char *); j++) {
+			bench_scenario(bench_table_sizes[i], scenarios[j]);
+			bench_report(bench_table_sizes[i], scenarios[j]);
+		}
+	}
+	return 0;
+}
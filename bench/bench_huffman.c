@@ -0,0 +1,249 @@
+/*
+ * Microbenchmark of huffman_decode() and huffman_encode().
+ *
+ * Sweep string lengths and character distributions. Each measurement
+ * cycles over a pool of about 64 KiB of strings. Per-byte numbers are of
+ * the raw (decoded) bytes, for both directions.
+ *
+ * Hardware counters are read by perf_event_open(2) if available, which
+ * may need kernel.perf_event_paranoid <= 2, or are shown as "-" otherwise.
+ * Build with `make HUFFMAN_DECODE_BYTE=1` to measure the byte-at-a-time
+ * decode table.
+ *
+ * Usage: bench_huffman
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "huffman.h"
+#include "bench.h"
+
+/* hardware counters */
+
+enum {
+	BENCH_PERF_CYCLES,
+	BENCH_PERF_INSTRUCTIONS,
+	BENCH_PERF_BRANCH_MISSES,
+	BENCH_PERF_L1D_MISSES,
+	BENCH_PERF_MAX,
+};
+
+static const struct {
+	uint32_t	type;
+	uint64_t	config;
+} bench_perf_events[BENCH_PERF_MAX] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+/* -1 if the counter is not available */
+static int bench_perf_fds[BENCH_PERF_MAX];
+
+static void bench_perf_open(void)
+{
+	int i;
+	for (i = 0; i < BENCH_PERF_MAX; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = bench_perf_events[i].type;
+		attr.config = bench_perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		bench_perf_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (bench_perf_fds[i] < 0 && i == 0) {
+			fprintf(stderr, "perf counters not available: %s\n", strerror(errno));
+		}
+	}
+}
+
+static void bench_perf_start(void)
+{
+	int i;
+	for (i = 0; i < BENCH_PERF_MAX; i++) {
+		if (bench_perf_fds[i] >= 0) {
+			ioctl(bench_perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(bench_perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/* set -1 in @counts for unavailable counters */
+static void bench_perf_stop(int64_t *counts)
+{
+	int i;
+	for (i = 0; i < BENCH_PERF_MAX; i++) {
+		uint64_t value;
+		counts[i] = -1;
+		if (bench_perf_fds[i] < 0) {
+			continue;
+		}
+		ioctl(bench_perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(bench_perf_fds[i], &value, sizeof(value)) == sizeof(value)) {
+			counts[i] = value;
+		}
+	}
+}
+
+/* input strings */
+
+#define BENCH_POOL_SIZE		(64 * 1024)
+
+static const char *bench_dist_names[] = { "token", "base64", "url", "random" };
+
+static const char *bench_dist_chars[] = {
+	"abcdefghijklmnopqrstuvwxyz0123456789-",
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+	"abcdefghijklmnopqrstuvwxyz0123456789/////..--__?=&%",
+	NULL, /* any byte */
+};
+
+static const int bench_lengths[] = { 8, 32, 128, 512, 2048, 8192 };
+
+struct bench_pool {
+	int		count;
+	int		length;
+	char		**raw;
+	uint8_t		**coded;
+	int		*coded_len;
+};
+
+static void bench_pool_init(struct bench_pool *pool, int dist, int length)
+{
+	const char *chars = bench_dist_chars[dist];
+	int chars_len = chars ? strlen(chars) : 0;
+	int i, j;
+
+	pool->length = length;
+	pool->count = BENCH_POOL_SIZE / length;
+	pool->raw = malloc(sizeof(char *) * pool->count);
+	pool->coded = malloc(sizeof(uint8_t *) * pool->count);
+	pool->coded_len = malloc(sizeof(int) * pool->count);
+
+	for (i = 0; i < pool->count; i++) {
+		char *raw = malloc(length);
+		for (j = 0; j < length; j++) {
+			raw[j] = chars ? chars[rand() % chars_len] : rand();
+		}
+		pool->raw[i] = raw;
+
+		int len = huffman_encoded_len(raw, length);
+		pool->coded[i] = malloc(len);
+		pool->coded_len[i] = huffman_encode(raw, length, pool->coded[i], len);
+		if (pool->coded_len[i] != len) {
+			fprintf(stderr, "huffman_encode() fails\n");
+			exit(1);
+		}
+	}
+}
+
+static void bench_pool_free(struct bench_pool *pool)
+{
+	int i;
+	for (i = 0; i < pool->count; i++) {
+		free(pool->raw[i]);
+		free(pool->coded[i]);
+	}
+	free(pool->raw);
+	free(pool->coded);
+	free(pool->coded_len);
+}
+
+/* benchmark */
+
+static int bench_decode_pass(const struct bench_pool *pool, char *out_buf)
+{
+	int i, total = 0;
+	for (i = 0; i < pool->count; i++) {
+		total += huffman_decode(pool->coded[i], pool->coded_len[i],
+				out_buf, pool->length + 1);
+	}
+	return total;
+}
+
+static int bench_encode_pass(const struct bench_pool *pool, uint8_t *out_buf)
+{
+	int i, total = 0;
+	for (i = 0; i < pool->count; i++) {
+		total += huffman_encode(pool->raw[i], pool->length,
+				out_buf, pool->coded_len[i]);
+	}
+	return total;
+}
+
+static void bench_run(const struct bench_pool *pool, const char *dist_name,
+		bool decode)
+{
+	static char out_buf[8192 * 4];
+	int64_t counts[BENCH_PERF_MAX];
+	uint64_t rounds, start, ns;
+	int i;
+
+	/* warm up, and check the round trip */
+	for (i = 0; i < pool->count; i++) {
+		if (huffman_decode(pool->coded[i], pool->coded_len[i], out_buf,
+					pool->length + 1) != pool->length
+				|| memcmp(out_buf, pool->raw[i], pool->length) != 0) {
+			fprintf(stderr, "huffman_decode() mismatch\n");
+			exit(1);
+		}
+	}
+
+	bench_perf_start();
+	start = bench_now_ns();
+	for (rounds = 0; (ns = bench_now_ns() - start) < BENCH_MIN_NS; rounds++) {
+		if (decode) {
+			bench_sink += bench_decode_pass(pool, out_buf);
+		} else {
+			bench_sink += bench_encode_pass(pool, (uint8_t *)out_buf);
+		}
+	}
+	bench_perf_stop(counts);
+
+	double bytes = (double)rounds * pool->count * pool->length;
+	printf("%-6s %-7s %5d %7.3f %8.1f", decode ? "decode" : "encode",
+			dist_name, pool->length, ns / bytes, bytes * 1000 / ns);
+	for (i = 0; i < BENCH_PERF_MAX; i++) {
+		if (counts[i] < 0) {
+			printf(" %8s", "-");
+		} else {
+			printf(" %8.3f", counts[i] / bytes);
+		}
+	}
+	printf("\n");
+}
+
+int main(void)
+{
+	int dist, j;
+
+	bench_perf_open();
+
+	/* all columns but MB/s are per raw byte */
+	printf("%-6s %-7s %5s %7s %8s %8s %8s %8s %8s\n", "op", "chars",
+			"len", "ns/B", "MB/s", "cycles", "instrs", "br-miss", "l1d-miss");
+
+	for (dist = 0; dist < sizeof(bench_dist_names) / sizeof(char *); dist++) {
+		for (j = 0; j < sizeof(bench_lengths) / sizeof(int); j++) {
+			struct bench_pool pool;
+			bench_pool_init(&pool, dist, bench_lengths[j]);
+			bench_run(&pool, bench_dist_names[dist], true);
+			bench_run(&pool, bench_dist_names[dist], false);
+			bench_pool_free(&pool);
+		}
+	}
+	return 0;
+}
@@ -20,6 +20,12 @@ const char *hpack_strerror(int errcode)
 		return "too long push entry";
 	case HPERR_INVALID_DYNAMIC_INDEX:
 		return "invalid dynamic index";
+	case HPERR_HEADER_LIST_TOO_LONG:
+		return "too long header list";
+	case HPERR_MALFORMED_HEADER:
+		return "malformed header";
+	case HPERR_INVALID_SIZE_UPDATE:
+		return "invalid table size update";
 	default:
 		return errcode < 0 ? "invalid error code" : "OK";
 	}
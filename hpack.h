@@ -15,6 +15,82 @@ typedef struct hpack_s hpack_t;
  */
 hpack_t *hpack_new(int max_size);
 
+/**
+ * @brief Memory allocator of a hpack context.
+ *
+ * The functions work as malloc(), realloc() and free() of libc,
+ * and are called with @data as the first argument.
+ */
+struct hpack_allocator {
+	void	*(*alloc)(void *data, size_t size);
+	void	*(*realloc)(void *data, void *ptr, size_t size);
+	void	(*free)(void *data, void *ptr);
+	void	*data;
+};
+
+/**
+ * @brief Create a hpack context with an allocator.
+ *
+ * All memory of the context, including the context itself, is allocated
+ * and freed by @allocator, which is copied. So the memory can be taken
+ * from a per-thread arena or a per-connection pool. The libc allocator
+ * is used if @allocator is NULL, same as hpack_new().
+ */
+hpack_t *hpack_new_ex(int max_size, const struct hpack_allocator *allocator);
+
+/**
+ * @brief Return the memory size needed by hpack_init() for @max_size.
+ */
+size_t hpack_context_size(int max_size);
+
+/**
+ * @brief Return the memory size for hpack_init() with the encoder index.
+ */
+size_t hpack_encoder_context_size(int max_size);
+
+/**
+ * @brief Create a hpack context in memory of @mem_size bytes at @mem.
+ *
+ * The context and its dynamic table of up to @max_size are placed in the
+ * memory, which must be aligned as malloc() and be at least
+ * hpack_context_size(max_size) bytes, about 1.5 times of @max_size
+ * (6416 bytes for 4096). So the context can be embedded in other
+ * structures, and it never allocates memory.
+ *
+ * With hpack_encoder_context_size(max_size) bytes, about 0.75 times of
+ * @max_size more, the memory also holds the encoder index. Without it,
+ * the encoder looks up the dynamic table by scanning all entries, which
+ * is fine for small tables. Decoders never need the index.
+ *
+ * Decoded huffman strings, and table strings wrapping around the end of
+ * the ring, are kept in the buffer set by hpack_decode_scratch(). They
+ * fail with HPERR_NOMEM without the buffer. Other operations that would
+ * need memory also return HPERR_NOMEM, including hpack_max_size() above
+ * @max_size, dry run of hpack_encode_block() over 1024 headers, spilling
+ * of hpack_encode_block_resume(), and names over 256 bytes and not in
+ * lower case.
+ *
+ * hpack_free() is not needed for the context, but does no harm.
+ *
+ * Return NULL if @mem_size is not enough.
+ */
+hpack_t *hpack_init(void *mem, size_t mem_size, int max_size);
+
+/**
+ * @brief Set the decode buffer of a context from hpack_init().
+ *
+ * Half of the buffer is for names and half for values, so a decoded
+ * string can be up to @size/2 bytes. The buffer is used only by the
+ * decode functions and by the strings they return, so one buffer can
+ * be shared by all contexts of a thread, as long as these strings are
+ * not used after decoding with another context, and no field is left
+ * in progress by hpack_decode_block_feed() meanwhile.
+ *
+ * Do nothing for contexts from hpack_new() and hpack_new_ex(), which
+ * allocate their own buffers.
+ */
+void hpack_decode_scratch(hpack_t *hpack, char *buf, int size);
+
 /**
  * @brief Free a hpack context.
  */
@@ -23,6 +99,17 @@ void hpack_free(hpack_t *);
 /**
  * @brief Reset the max_size.
  *
+ * For an encoder context, a Dynamic Table Size Update is emitted at the
+ * beginning of the next block by hpack_encode_block() and other block
+ * functions, or by hpack_encode_size_update() if headers are encoded one
+ * by one. So call it between header blocks only.
+ *
+ * For a decoder context, @max_size is also the limit of Dynamic Table
+ * Size Updates from the peer, such as SETTINGS_HEADER_TABLE_SIZE of
+ * HTTP/2, see RFC 7541 Section 6.3. The max_size of hpack_new() is the
+ * initial limit. Decoding fails with HPERR_INVALID_SIZE_UPDATE if an
+ * update exceeds it.
+ *
  * Return 0 if OK, or negetive error code if fail.
  */
 int hpack_max_size(hpack_t *hpack, int max_size);
@@ -33,6 +120,9 @@ int hpack_max_size(hpack_t *hpack, int max_size);
  * The name-value buffers will be covered in next decoding, so you
  * must copy them out if you want use them later.
  *
+ * Decoded strings are kept in the hpack context, so different contexts
+ * can be used in different threads at the same time.
+ *
  * Return processed input buffer length if OK, or negetive error code if fail.
  */
 int hpack_decode_header(hpack_t *hpack,
@@ -40,6 +130,240 @@ int hpack_decode_header(hpack_t *hpack,
 		const char **name_str, int *name_len,
 		const char **value_str, int *value_len);
 
+/**
+ * @brief Extended well-known header names, which get tokens after the
+ * names in the static table.
+ *
+ * You can define your own list when building the library and including
+ * this file, with X(ID, "name") for each name in lower case.
+ */
+#ifndef HPACK_TOKEN_EXTENDED
+#define HPACK_TOKEN_EXTENDED(X) \
+	X(CONNECTION, "connection") \
+	X(KEEP_ALIVE, "keep-alive") \
+	X(PROXY_CONNECTION, "proxy-connection") \
+	X(TE, "te") \
+	X(UPGRADE, "upgrade") \
+	X(FORWARDED, "forwarded") \
+	X(X_FORWARDED_FOR, "x-forwarded-for") \
+	X(X_FORWARDED_HOST, "x-forwarded-host") \
+	X(X_FORWARDED_PROTO, "x-forwarded-proto") \
+	X(X_REAL_IP, "x-real-ip") \
+	X(X_REQUEST_ID, "x-request-id") \
+	X(ORIGIN, "origin") \
+	X(GRPC_STATUS, "grpc-status") \
+	X(GRPC_MESSAGE, "grpc-message") \
+	X(GRPC_TIMEOUT, "grpc-timeout") \
+	X(GRPC_ENCODING, "grpc-encoding") \
+	X(GRPC_ACCEPT_ENCODING, "grpc-accept-encoding")
+#endif
+
+/**
+ * @brief Tokens of well-known header names.
+ *
+ * A name in the static table gets the index of its first entry there.
+ */
+enum hpack_token {
+	HPACK_TOKEN_UNKNOWN = 0,
+
+	HPACK_TOKEN_AUTHORITY = 1,
+	HPACK_TOKEN_METHOD = 2,
+	HPACK_TOKEN_PATH = 4,
+	HPACK_TOKEN_SCHEME = 6,
+	HPACK_TOKEN_STATUS = 8,
+	HPACK_TOKEN_ACCEPT_CHARSET = 15,
+	HPACK_TOKEN_ACCEPT_ENCODING,
+	HPACK_TOKEN_ACCEPT_LANGUAGE,
+	HPACK_TOKEN_ACCEPT_RANGES,
+	HPACK_TOKEN_ACCEPT,
+	HPACK_TOKEN_ACCESS_CONTROL_ALLOW_ORIGIN,
+	HPACK_TOKEN_AGE,
+	HPACK_TOKEN_ALLOW,
+	HPACK_TOKEN_AUTHORIZATION,
+	HPACK_TOKEN_CACHE_CONTROL,
+	HPACK_TOKEN_CONTENT_DISPOSITION,
+	HPACK_TOKEN_CONTENT_ENCODING,
+	HPACK_TOKEN_CONTENT_LANGUAGE,
+	HPACK_TOKEN_CONTENT_LENGTH,
+	HPACK_TOKEN_CONTENT_LOCATION,
+	HPACK_TOKEN_CONTENT_RANGE,
+	HPACK_TOKEN_CONTENT_TYPE,
+	HPACK_TOKEN_COOKIE,
+	HPACK_TOKEN_DATE,
+	HPACK_TOKEN_ETAG,
+	HPACK_TOKEN_EXPECT,
+	HPACK_TOKEN_EXPIRES,
+	HPACK_TOKEN_FROM,
+	HPACK_TOKEN_HOST,
+	HPACK_TOKEN_IF_MATCH,
+	HPACK_TOKEN_IF_MODIFIED_SINCE,
+	HPACK_TOKEN_IF_NONE_MATCH,
+	HPACK_TOKEN_IF_RANGE,
+	HPACK_TOKEN_IF_UNMODIFIED_SINCE,
+	HPACK_TOKEN_LAST_MODIFIED,
+	HPACK_TOKEN_LINK,
+	HPACK_TOKEN_LOCATION,
+	HPACK_TOKEN_MAX_FORWARDS,
+	HPACK_TOKEN_PROXY_AUTHENTICATE,
+	HPACK_TOKEN_PROXY_AUTHORIZATION,
+	HPACK_TOKEN_RANGE,
+	HPACK_TOKEN_REFERER,
+	HPACK_TOKEN_REFRESH,
+	HPACK_TOKEN_RETRY_AFTER,
+	HPACK_TOKEN_SERVER,
+	HPACK_TOKEN_SET_COOKIE,
+	HPACK_TOKEN_STRICT_TRANSPORT_SECURITY,
+	HPACK_TOKEN_TRANSFER_ENCODING,
+	HPACK_TOKEN_USER_AGENT,
+	HPACK_TOKEN_VARY,
+	HPACK_TOKEN_VIA,
+	HPACK_TOKEN_WWW_AUTHENTICATE,
+
+#define HPACK_TOKEN_X(id, name) HPACK_TOKEN_##id,
+	HPACK_TOKEN_EXTENDED(HPACK_TOKEN_X)
+#undef HPACK_TOKEN_X
+
+	HPACK_TOKEN_MAX,
+};
+
+/**
+ * @brief Return the token of a header name in lower case,
+ * or HPACK_TOKEN_UNKNOWN if not well-known.
+ */
+int hpack_name_token(const char *name_str, int name_len);
+
+/**
+ * @brief A header of name-value pair.
+ *
+ * The token is set by decoding, and is not used by encoding.
+ *
+ * If value_huffman is set by lazy decoding, the value is still in
+ * huffman encoding, see hpack_decode_lazy_huffman(). The encoding
+ * outputs it as it is, without indexing.
+ *
+ * The never_indexed is set by decoding if the header is Never Indexed,
+ * and the encoding keeps it so, see RFC 7541 Section 7.1.3.
+ */
+struct hpack_header {
+	const char	*name_str;
+	int		name_len;
+	const char	*value_str;
+	int		value_len;
+	int		token;		/* enum hpack_token */
+	bool		value_huffman;
+	bool		never_indexed;
+};
+
+/**
+ * @brief Handler called for each decoded header.
+ *
+ * Return 0 to continue decoding, or others to stop.
+ */
+typedef int (*hpack_header_f)(void *data, const struct hpack_header *header);
+
+/**
+ * @brief Decode a whole header block from buffer defined by @in_buf and
+ * @in_end, and call @handler for each header.
+ * The name-value buffers are valid only in the @handler call.
+ *
+ * The header list size (see RFC 7540 Section 6.5.2) is limited by
+ * @max_list_size, or not limited if 0.
+ *
+ * Return 0 if OK, or non-zero returned by @handler,
+ * or negetive error code if fail.
+ */
+int hpack_decode_block(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		hpack_header_f handler, void *data);
+
+/**
+ * @brief Decode a header block which arrives in fragments, such as
+ * payloads of HEADERS and CONTINUATION frames, and call @handler for
+ * each header.
+ *
+ * Call this for each fragment as it arrives, and set @end_block for the
+ * last one. The input is consumed in place. A header split across
+ * fragments is kept in the hpack context, so the fragment buffer can be
+ * reused after the call. Its strings are copied into the context, and
+ * the copying is bounded by @max_list_size if it is not 0.
+ *
+ * Do not decode other blocks with this context before the block ends.
+ * The state is cleared at the end of block, or if fail.
+ *
+ * Return 0 if OK, or non-zero returned by @handler,
+ * or negetive error code if fail.
+ * HPERR_AGAIN is returned if the block ends in the middle of a header.
+ */
+int hpack_decode_block_feed(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, bool end_block,
+		int max_list_size, hpack_header_f handler, void *data);
+
+/**
+ * @brief Set lazy huffman decoding of values for the block decoders.
+ *
+ * If set, a huffman-encoded value is left in the input buffer, if it is
+ * not to be added into the dynamic table. The value_huffman of header is
+ * set, and value_str and value_len are the raw span. It is decoded only
+ * when you call hpack_header_value(). The decoded length is not longer
+ * than HPACK_HUFFMAN_DECODED_MAX_LEN(value_len), which is also used for
+ * the header list size.
+ *
+ * The header split across fragments in hpack_decode_block_feed() is
+ * always decoded.
+ */
+void hpack_decode_lazy_huffman(hpack_t *hpack, bool lazy);
+
+/**
+ * @brief The upper bound of decoded length of huffman string.
+ */
+#define HPACK_HUFFMAN_DECODED_MAX_LEN(len)	((len) * 8 / 5)
+
+/**
+ * @brief Output the value of a decoded header into the buffer defined
+ * by @out_buf and @out_end, and decode it if in huffman.
+ *
+ * Return the value length if OK, or negetive error code if fail.
+ */
+int hpack_header_value(const struct hpack_header *header,
+		char *out_buf, char *out_end);
+
+/**
+ * @brief Decode a whole header block into @headers array.
+ *
+ * This is a special case of hpack_decode_block().
+ *
+ * Strings not in the input buffer, such as decoded huffman strings and
+ * table entries, are copied into buffer defined by @str_buf and @str_end.
+ *
+ * If @max_headers or the string buffer is not enough, the rest of the
+ * block is still decoded without being stored, so the dynamic table keeps
+ * in sync and the context can go on with the next block. HPERR_NO_SPACE
+ * is returned then.
+ *
+ * Return the number of headers if OK, or negetive error code if fail.
+ */
+int hpack_decode_block_array(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		struct hpack_header *headers, int max_headers,
+		char *str_buf, char *str_end);
+
+/**
+ * @brief Emit the Dynamic Table Size Update pending since hpack_max_size().
+ *
+ * Call it at the beginning of each header block, if the block is encoded
+ * by hpack_encode_status(), hpack_encode_content_length() and
+ * hpack_encode_header(), which do not emit it, since it must be before
+ * all headers, see RFC 7541 Section 4.2. Block functions such as
+ * hpack_encode_block() emit it themselves.
+ *
+ * If @out_buf is NULL, nothing is written and the update is still
+ * pending, but the length is returned.
+ *
+ * Return encoded buffer length, 0 if nothing pending, or negetive error
+ * code if fail.
+ */
+int hpack_encode_size_update(hpack_t *hpack, uint8_t *out_buf, uint8_t *out_end);
+
 /**
  * @brief Encode :status header.
  *
@@ -59,6 +383,8 @@ int hpack_encode_status(int status, uint8_t *out_buf, uint8_t *out_end);
  *
  * Since content_length is in static-table and the value is an integer,
  * dynamic table will not be used. So hpack context argument is not need.
+ * The header is encoded as literal without indexing, so that the dynamic
+ * tables of both ends keep in sync.
  *
  * Return encoded buffer length if OK, or negetive error code if fail.
  */
@@ -67,15 +393,212 @@ int hpack_encode_content_length(size_t content_length, uint8_t *out_buf, uint8_t
 /**
  * @brief Encode a header.
  *
+ * If found in the dynamic table, the header is encoded as an index.
+ * Otherwise it is encoded as literal, and added into the dynamic table
+ * if the indexing policy allows, see hpack_index_policy().
+ *
  * If you do not want add the header into dynamic table if not in static
  * table, you can pass "NULL" as the hpack argument.
  *
+ * The name is encoded in lower case, and it is used without copying if
+ * it is already. The value is encoded as it is.
+ *
  * Return encoded buffer length if OK, or negetive error code if fail.
  */
 int hpack_encode_header(hpack_t *hpack, const char *name_str, int name_len,
 		const char *value_str, int value_len,
 		uint8_t *out_buf, uint8_t *out_end);
 
+/**
+ * @brief How a literal header is encoded, see RFC 7541 Section 6.2.
+ */
+enum hpack_indexing {
+	HPACK_INDEXING,		/* with Incremental Indexing */
+	HPACK_INDEXING_NONE,	/* without Indexing */
+	HPACK_INDEXING_NEVER,	/* Never Indexed, for sensitive headers */
+};
+
+/**
+ * @brief Policy to decide how to encode a header which is not found
+ * in tables. The name is in lower case.
+ */
+typedef enum hpack_indexing (*hpack_index_policy_f)(void *data,
+		const char *name_str, int name_len,
+		const char *value_str, int value_len);
+
+/**
+ * @brief Values longer than this are not indexed by the default policy.
+ */
+#define HPACK_INDEX_VALUE_MAX	256
+
+/**
+ * @brief The default policy.
+ *
+ * Authorization, proxy-authorization, cookie and set-cookie are never
+ * indexed. Headers whose values change in almost every message, such as
+ * date, etag and x-request-id, and values longer than
+ * HPACK_INDEX_VALUE_MAX, are not indexed. Others are indexed.
+ *
+ * You can call it in your policy as fallback.
+ */
+enum hpack_indexing hpack_index_policy_default(void *data,
+		const char *name_str, int name_len,
+		const char *value_str, int value_len);
+
+/**
+ * @brief Set the encoder indexing policy of a context.
+ *
+ * The @policy is called with @data. The default policy is used if NULL.
+ *
+ * Never-indexed headers are not looked up as name-value pair in the
+ * dynamic table either. If the hpack context is NULL, the default policy
+ * is used to find never-indexed headers.
+ *
+ * For values passed through in huffman by hpack_transcode_block(), the
+ * policy is called with NULL value and 0 length, and they are encoded
+ * as never indexed if it returns HPACK_INDEXING_NEVER, or without
+ * indexing otherwise.
+ */
+void hpack_index_policy(hpack_t *hpack, hpack_index_policy_f policy, void *data);
+
+/**
+ * @brief Encode a whole header block of @count @headers.
+ *
+ * If @out_buf is NULL, nothing is written and the dynamic table is not
+ * changed, but the exact length that would be encoded is returned,
+ * so you can allocate the output buffer. The following call with
+ * an output buffer and the same @headers will output this length.
+ * The dry run looks up the table as the real one, while the inserts and
+ * evictions of the block are only counted, so it takes no copy.
+ *
+ * Return encoded buffer length if OK, or negetive error code if fail.
+ */
+int hpack_encode_block(hpack_t *hpack, const struct hpack_header *headers,
+		int count, uint8_t *out_buf, uint8_t *out_end);
+
+/**
+ * @brief Encode a whole header block into successive buffers, such as
+ * payloads of HEADERS and CONTINUATION frames.
+ *
+ * Headers are encoded into @out_buf until it is full. The header at the
+ * end of buffer is split, and the rest of it is kept in the hpack
+ * context and output first in the next call.
+ *
+ * @next is the index of the header to encode, which must be set to 0
+ * before the first call. Call this with the same @headers and @count
+ * and a new buffer each time, until @next reaches @count.
+ * Do not encode other headers with this context before that.
+ *
+ * The hpack context is needed. Create one with max_size of 0 if you do
+ * not want the dynamic table.
+ *
+ * Return the length written into @out_buf if OK, or negetive error code
+ * if fail.
+ */
+int hpack_encode_block_resume(hpack_t *hpack, const struct hpack_header *headers,
+		int count, int *next, uint8_t *out_buf, uint8_t *out_end);
+
+/**
+ * @brief Transcode a header block from the @decoder context to the
+ * @encoder context, for proxying between HTTP/2 connections.
+ *
+ * Headers not indexed by the upstream are passed through without
+ * indexing, and their huffman-encoded values are copied as they are
+ * without decoding. Other headers are decoded and then encoded as
+ * hpack_encode_block(). Never-indexed headers are kept so.
+ *
+ * If @max_list_size is not 0 and the output buffer is not smaller than
+ * it, HPERR_NO_SPACE is not returned.
+ *
+ * If encoding fails, the rest of the block is still decoded, so the
+ * @decoder keeps in sync with the upstream. But the @encoder may have
+ * indexed headers of the discarded output, so it must be discarded
+ * with the downstream connection after a failure.
+ *
+ * Return encoded buffer length if OK, or negetive error code if fail.
+ */
+int hpack_transcode_block(hpack_t *decoder,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		hpack_t *encoder, uint8_t *out_buf, uint8_t *out_end);
+
+/**
+ * @brief Decode a request header block into HTTP/1.1 request line and
+ * header lines, in the buffer defined by @out_buf and @out_end.
+ *
+ * :method and :path make the request line, or :authority instead of
+ * :path for CONNECT. :authority is output as Host header, which takes
+ * place of the host header if any. :scheme is dropped. Cookies are
+ * joined into one line at the end.
+ *
+ * Huffman values are decoded into their final place in the output.
+ * Pseudo-headers and cookies are staged at the end of the output buffer,
+ * so the buffer must have room for them too. If the output fails, the
+ * rest of the block is still decoded without output, so the dynamic table
+ * keeps in sync and the context can go on with the next block.
+ *
+ * The output is not terminated by the empty line, so you can append
+ * more headers.
+ *
+ * Return the output length if OK, or negetive error code if fail.
+ * HPERR_MALFORMED_HEADER is returned for invalid pseudo-headers, including
+ * empty or SP and HTAB in :method and the request target, or for
+ * characters that can not be in HTTP/1.1 headers.
+ */
+int hpack_decode_http1(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		char *out_buf, char *out_end);
+
+/**
+ * @brief Encode a HTTP/1.1 response header section, defined by @in_buf
+ * and @in_end, which begins with the status line and ends with an empty
+ * line or @in_end.
+ *
+ * The status is encoded by hpack_encode_status(). Header names are
+ * lowercased and values are trimmed. Connection-specific headers,
+ * including those listed in Connection headers, are removed.
+ *
+ * Return encoded buffer length if OK, or negetive error code if fail.
+ * HPERR_MALFORMED_HEADER is returned for invalid status line or header
+ * lines, including obsolete line folding.
+ */
+int hpack_encode_http1(hpack_t *hpack, const char *in_buf, const char *in_end,
+		uint8_t *out_buf, uint8_t *out_end);
+
+/**
+ * @brief Statistics of a hpack context, for encoding or decoding.
+ */
+struct hpack_stats {
+	/* Indexed Header Fields */
+	uint64_t	indexed_static;
+	uint64_t	indexed_dynamic;
+
+	/* Literal Header Fields, by representation */
+	uint64_t	literal_indexing;
+	uint64_t	literal_none;
+	uint64_t	literal_never;
+
+	uint64_t	raw_bytes;		/* of header names and values */
+	uint64_t	coded_bytes;		/* of header blocks */
+	uint64_t	huffman_saved_bytes;
+
+	/* dynamic table */
+	uint64_t	inserts;
+	uint64_t	evicts;
+	uint64_t	size_updates;
+	int		table_entries;
+	int		table_size;
+	int		table_max_size;
+};
+
+/**
+ * @brief Get statistics of a context.
+ *
+ * The counters are updated only if the library is built with
+ * HPACK_STATS defined, or they are all 0. The table_* fields are
+ * always set.
+ */
+void hpack_get_stats(hpack_t *hpack, struct hpack_stats *stats);
+
 /**
  * @brief Convert error code into string.
  */
@@ -92,6 +615,9 @@ enum HPACK_ERRNO {
 	HPERR_HUFFMAN,
 	HPERR_DYN_ENTRY_TOO_LONG,
 	HPERR_INVALID_DYNAMIC_INDEX,
+	HPERR_HEADER_LIST_TOO_LONG,
+	HPERR_MALFORMED_HEADER,
+	HPERR_INVALID_SIZE_UPDATE,
 };
 
 #endif
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 #include "hpack.h"
 #include "huffman.h"
@@ -7,55 +11,109 @@
 #include "hpack_dynamic.h"
 
 static int hpack_get(hpack_t *hpack, int index,
-		const char **name_str, int *name_len,
+		const char **name_str, int *name_len, int *token,
 		const char **value_str, int *value_len)
 {
-	if (index <= 0) {
+	if (index < 0) {
 		return index;
 	}
+	if (index == 0) { /* see RFC 7541 Section 6.1 */
+		return HPERR_INVALID_DYNAMIC_INDEX;
+	}
 
 	if (hpack_static_decode(index, name_str, name_len, value_str, value_len)) {
+		*token = hpack_static_token(index);
 		return 0;
 	}
 
-	if (hpack_dynamic_decode(hpack, index, name_str, name_len, value_str, value_len)) {
-		return 0;
-	}
+	return hpack_dynamic_decode(hpack, index, name_str, name_len, token,
+			value_str, value_len);
+}
 
-	return HPERR_INVALID_DYNAMIC_INDEX;
+/* Gather the 7-bit groups of at most 5 bytes loaded in little-endian.
+ * The bytes after the last one must have been masked out. */
+static inline uint64_t hpack_decode_int_gather(uint64_t x)
+{
+#ifdef __BMI2__
+	return _pext_u64(x, 0x7f7f7f7f7full);
+#else
+	return (x & 0x7f) | ((x >> 1) & 0x3f80) | ((x >> 2) & 0x1fc000)
+			| ((x >> 3) & 0xfe00000) | ((x >> 4) & 0x7f0000000ull);
+#endif
 }
 
+/* Values up to INT_MAX are accepted, which need 5 bytes at most
+ * after the prefix. */
+#define HPACK_DECODE_INT_MAX_BYTES	5
+
 static int hpack_decode_int(uint8_t const **in_pos_p, const uint8_t *in_end,
 		int prefix_bits)
 {
-	uint8_t prefix_max = (1 << prefix_bits) - 1;
+	uint32_t prefix_max = (1 << prefix_bits) - 1;
 
-	uint8_t value = *((*in_pos_p)++);
-	int n = value & prefix_max;
+	const uint8_t *in_pos = *in_pos_p;
+	if (in_pos >= in_end) {
+		return HPERR_AGAIN;
+	}
+	uint32_t n = *in_pos++ & prefix_max;
 	if (n != prefix_max) {
+		*in_pos_p = in_pos;
 		return n;
 	}
 
-	if (in_end - *in_pos_p > 3) { /* 3 bytes at most */
-		in_end = *in_pos_p + 3;
-	}
+	uint64_t value;
+	int nbytes;
+	if (in_end - in_pos >= 8) {
+		/* fast path: one load, and find the last byte by its 0 MSB */
+		uint64_t x;
+		memcpy(&x, in_pos, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		x = __builtin_bswap64(x);
+#endif
+		uint64_t ends = ~x & 0x8080808080ull;
+		if (ends == 0) {
+			return HPERR_DECODE_INT;
+		}
+		nbytes = (__builtin_ctzll(ends) + 1) / 8;
+		value = hpack_decode_int_gather(x & ((1ull << (nbytes * 8)) - 1));
 
-	int shift = 0;
-	while (*in_pos_p < in_end) {
-		value = *((*in_pos_p)++);
-		n += (value & 0x7f) << shift;
-		if ((value & 0x80) == 0) {
-			return n;
+	} else {
+		/* tail path, near the end of input */
+		value = 0;
+		for (nbytes = 0; ; nbytes++) {
+			if (nbytes == HPACK_DECODE_INT_MAX_BYTES) {
+				return HPERR_DECODE_INT;
+			}
+			if (in_pos + nbytes >= in_end) {
+				return HPERR_AGAIN;
+			}
+			uint8_t b = in_pos[nbytes];
+			value |= (uint64_t)(b & 0x7f) << (nbytes * 7);
+			if ((b & 0x80) == 0) {
+				nbytes++;
+				break;
+			}
 		}
-		shift += 7;
 	}
-	return HPERR_DECODE_INT;
+
+	value += n;
+	if (value > INT_MAX) {
+		return HPERR_DECODE_INT;
+	}
+	*in_pos_p = in_pos + nbytes;
+	return value;
 }
 
-static int hpack_decode_string(const uint8_t **in_pos_p, const uint8_t *in_end,
-		const char **out_pos_p, int *out_len_p)
+/* If @lazy_huffman is not NULL, a huffman string is left in input
+ * and it is set. */
+static int hpack_decode_string(hpack_t *hpack, int which,
+		const uint8_t **in_pos_p, const uint8_t *in_end,
+		const char **out_pos_p, int *out_len_p, bool *lazy_huffman)
 {
-	int is_huffman = *in_pos_p[0] & 0x80;
+	if (*in_pos_p >= in_end) {
+		return HPERR_AGAIN;
+	}
+	int is_huffman = (*in_pos_p)[0] & 0x80;
 
 	int len = hpack_decode_int(in_pos_p, in_end, 7);
 	if (len < 0) {
@@ -65,15 +123,24 @@ static int hpack_decode_string(const uint8_t **in_pos_p, const uint8_t *in_end,
 		return HPERR_AGAIN;
 	}
 
-	static char huffman_bufs[2][4096];
-	static int huffman_count;
-	if (is_huffman) {
-		char *out = huffman_bufs[huffman_count++ % 2];
-		int decode_len = huffman_decode(*in_pos_p, len, out, 4096);
+	if (is_huffman && lazy_huffman == NULL) {
+		int size = HUFFMAN_DECODED_MAX_LEN(len) + 1;
+		bool capped = false;
+		if (hpack->fixed && size > hpack->decode_buf_sizes[which]) {
+			/* the estimate is loose, so try the buffer anyway */
+			size = hpack->decode_buf_sizes[which];
+			capped = true;
+		}
+		char *out = hpack_decode_buffer(hpack, which, size);
+		if (out == NULL) {
+			return HPERR_NOMEM;
+		}
+		int decode_len = huffman_decode(*in_pos_p, len, out, size);
 		if (decode_len < 0) {
-			return HPERR_HUFFMAN;
+			return capped ? HPERR_NOMEM : HPERR_HUFFMAN;
 		}
 		*in_pos_p += len;
+		HPACK_STATS_ADD(hpack, huffman_saved_bytes, decode_len - len);
 
 		*out_pos_p = out;
 		*out_len_p = decode_len;
@@ -81,33 +148,64 @@ static int hpack_decode_string(const uint8_t **in_pos_p, const uint8_t *in_end,
 	} else {
 		*out_pos_p = (const char *)(*in_pos_p);
 		*out_len_p = len;
+		if (lazy_huffman != NULL) {
+			*lazy_huffman = is_huffman;
+		}
 
 		*in_pos_p += len;
 		return 0;
 	}
 }
 
-int hpack_decode_header(hpack_t *hpack,
-		const uint8_t *in_buf, const uint8_t *in_end,
-		const char **name_str, int *name_len,
-		const char **value_str, int *value_len)
+/* count a decoded header by the first byte of field */
+static void hpack_decode_count(hpack_t *hpack, uint8_t first, int index,
+		const struct hpack_header *header)
+{
+	if (first & 0x80) {
+		if (index > HPACK_STATIC_TABLE_SIZE) {
+			HPACK_STATS_ADD(hpack, indexed_dynamic, 1);
+		} else {
+			HPACK_STATS_ADD(hpack, indexed_static, 1);
+		}
+	} else if (first & 0x40) {
+		HPACK_STATS_ADD(hpack, literal_indexing, 1);
+	} else if (first & 0x10) {
+		HPACK_STATS_ADD(hpack, literal_never, 1);
+	} else {
+		HPACK_STATS_ADD(hpack, literal_none, 1);
+	}
+	HPACK_STATS_ADD(hpack, raw_bytes, header->name_len + header->value_len);
+}
+
+/* Return 1 for a header, 0 for a dynamic table size update,
+ * or negetive error code if fail.
+ * The value is left in huffman if @lazy and not to be indexed. */
+static int hpack_decode_field(hpack_t *hpack, const uint8_t **in_pos_p,
+		const uint8_t *in_end, struct hpack_header *header, bool lazy)
 {
-	if (in_buf >= in_end) {
+	if (*in_pos_p >= in_end) {
 		return HPERR_AGAIN;
 	}
+	header->value_huffman = false;
+	header->never_indexed = false;
 
-	uint8_t first = in_buf[0];
-	const uint8_t *in_pos = in_buf;
-	const uint8_t **in_pos_p = &in_pos;
+	uint8_t first = (*in_pos_p)[0];
+	const char **name_str = &header->name_str;
+	int *name_len = &header->name_len;
+	int *token = &header->token;
+	const char **value_str = &header->value_str;
+	int *value_len = &header->value_len;
 
 	/* -- Indexed Header Field */
 	if (first & 0x80) {
-		int ret = hpack_get(hpack, hpack_decode_int(in_pos_p, in_end, 7),
-				name_str, name_len, value_str, value_len);
+		int index = hpack_decode_int(in_pos_p, in_end, 7);
+		int ret = hpack_get(hpack, index, name_str, name_len, token,
+				value_str, value_len);
 		if (ret < 0) {
 			return ret;
 		}
-		return in_pos - in_buf;
+		hpack_decode_count(hpack, first, index, header);
+		return 1;
 	}
 
 	/* -- Literal Header Field */
@@ -117,14 +215,15 @@ int hpack_decode_header(hpack_t *hpack,
 
 	/* -- Dynamic Table Size Update */
 	} else if (first & 0x20) {
-		int ret = hpack_max_size(hpack, hpack_decode_int(in_pos_p, in_end, 4));
+		int ret = hpack_dynamic_max_size(hpack, hpack_decode_int(in_pos_p, in_end, 5));
 		if (ret < 0) {
 			return ret;
 		}
-		return in_pos - in_buf;
+		return 0;
 
 	} else if (first & 0x10) { /* Never Indexed */
 		prefix_bits = 4;
+		header->never_indexed = true;
 	} else { /* without Indexing */
 		prefix_bits = 4;
 	}
@@ -132,22 +231,502 @@ int hpack_decode_header(hpack_t *hpack,
 	/* name */
 	int index = hpack_decode_int(in_pos_p, in_end, prefix_bits);
 	int ret = (index == 0)
-			? hpack_decode_string(in_pos_p, in_end, name_str, name_len)
-			: hpack_get(hpack, index, name_str, name_len, NULL, NULL);
+			? hpack_decode_string(hpack, 0, in_pos_p, in_end, name_str, name_len, NULL)
+			: hpack_get(hpack, index, name_str, name_len, token, NULL, NULL);
 	if (ret < 0) {
 		return ret;
 	}
+	if (index == 0) {
+		*token = hpack_name_token(*name_str, *name_len);
+	}
 
-	/* value */
-	ret = hpack_decode_string(in_pos_p, in_end, value_str, value_len);
+	/* value, which must be decoded if to be indexed */
+	ret = hpack_decode_string(hpack, 1, in_pos_p, in_end, value_str, value_len,
+			(lazy && prefix_bits != 6) ? &header->value_huffman : NULL);
 	if (ret < 0) {
 		return ret;
 	}
 
 	/* add to dynamic table */
 	if (prefix_bits == 6) {
-		hpack_dynamic_add(hpack, *name_str, *name_len, *value_str, *value_len);
+		ret = hpack_dynamic_add(hpack, *name_str, *name_len,
+				*value_str, *value_len, *token);
+		if (ret == HPERR_NOMEM) {
+			return ret;
+		}
+
+		/* the name may be in an evicted entry, so use the new one */
+		if (ret == 0 && index > HPACK_STATIC_TABLE_SIZE) {
+			hpack_get(hpack, HPACK_STATIC_TABLE_SIZE + 1, name_str, name_len,
+					token, NULL, NULL);
+		}
+	}
+
+	hpack_decode_count(hpack, first, index, header);
+	return 1;
+}
+
+int hpack_decode_header(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end,
+		const char **name_str, int *name_len,
+		const char **value_str, int *value_len)
+{
+	const uint8_t *in_pos = in_buf;
+	struct hpack_header header;
+	int ret = hpack_decode_field(hpack, &in_pos, in_end, &header, false);
+	if (ret < 0) {
+		return ret;
 	}
 
+	if (ret > 0) {
+		*name_str = header.name_str;
+		*name_len = header.name_len;
+		*value_str = header.value_str;
+		*value_len = header.value_len;
+	}
+	HPACK_STATS_ADD(hpack, coded_bytes, in_pos - in_buf);
 	return in_pos - in_buf;
 }
+
+/* steps of hpack_decode_feed_field() */
+enum {
+	HPACK_FEED_FIRST = 0,
+	HPACK_FEED_INDEX,
+	HPACK_FEED_NAME_LEN,
+	HPACK_FEED_NAME,
+	HPACK_FEED_VALUE_LEN,
+	HPACK_FEED_VALUE,
+};
+
+/* Feed an integer whose first byte is ds->first or the string length
+ * byte. Return 1 if it is done, 0 if more input is needed,
+ * or negetive error code if fail. */
+static int hpack_feed_int(struct hpack_decode_state *ds, int prefix_bits,
+		const uint8_t **in_pos_p, const uint8_t *in_end)
+{
+	if (!ds->int_more) {
+		uint8_t prefix_max = (1 << prefix_bits) - 1;
+		ds->int_value = *((*in_pos_p)++) & prefix_max;
+		if (ds->int_value != prefix_max) {
+			return 1;
+		}
+		ds->int_more = true;
+		ds->int_shift = 0;
+	}
+
+	while (*in_pos_p < in_end) {
+		uint8_t value = *((*in_pos_p)++);
+		ds->int_value += (uint64_t)(value & 0x7f) << ds->int_shift;
+		if (ds->int_value > INT_MAX) {
+			return HPERR_DECODE_INT;
+		}
+		if ((value & 0x80) == 0) {
+			ds->int_more = false;
+			return 1;
+		}
+		ds->int_shift += 7;
+		if (ds->int_shift > 28) {
+			return HPERR_DECODE_INT;
+		}
+	}
+	return 0;
+}
+
+/* Feed a string into decode_bufs[@which]. Return 1 if it is done,
+ * 0 if more input is needed, or negetive error code if fail. */
+static int hpack_feed_string(hpack_t *hpack, int which,
+		const uint8_t **in_pos_p, const uint8_t *in_end)
+{
+	struct hpack_decode_state *ds = &hpack->decode_state;
+
+	int in_len = in_end - *in_pos_p;
+	if (in_len > ds->str_left) {
+		in_len = ds->str_left;
+	}
+
+	if (ds->is_huffman) {
+		/* pending bits of last input may be decoded now */
+		int size = HUFFMAN_DECODED_MAX_LEN(ds->str_in + in_len);
+		bool capped = false;
+		if (hpack->fixed && size + 1 > hpack->decode_buf_sizes[which]) {
+			/* the estimate is loose, so try the buffer anyway */
+			size = hpack->decode_buf_sizes[which] - 1;
+			capped = true;
+		}
+		char *out = hpack_decode_buffer(hpack, which, size + 1);
+		if (out == NULL) {
+			return HPERR_NOMEM;
+		}
+		const uint8_t *in_pos = *in_pos_p;
+		int len = huffman_decoder_feed(&ds->huffman, &in_pos, in_pos + in_len,
+				out + ds->str_len, size - ds->str_len);
+		if (len < 0 || in_pos != *in_pos_p + in_len) {
+			return capped ? HPERR_NOMEM : HPERR_HUFFMAN;
+		}
+		ds->str_len += len;
+	} else {
+		char *out = hpack_decode_buffer(hpack, which, ds->str_len + in_len + 1);
+		if (out == NULL) {
+			return HPERR_NOMEM;
+		}
+		memcpy(out + ds->str_len, *in_pos_p, in_len);
+		ds->str_len += in_len;
+	}
+	*in_pos_p += in_len;
+	ds->str_in += in_len;
+	ds->str_left -= in_len;
+
+	if (ds->str_left > 0) {
+		return 0;
+	}
+	if (ds->is_huffman) {
+		if (!huffman_decoder_finish(&ds->huffman)) {
+			return HPERR_HUFFMAN;
+		}
+		HPACK_STATS_ADD(hpack, huffman_saved_bytes, ds->str_len - ds->str_in);
+	}
+	return 1;
+}
+
+/* Feed the string length, the first byte of which is at *in_pos_p. */
+static int hpack_feed_string_len(hpack_t *hpack, int which,
+		const uint8_t **in_pos_p, const uint8_t *in_end)
+{
+	struct hpack_decode_state *ds = &hpack->decode_state;
+	if (!ds->int_more) {
+		ds->is_huffman = (*in_pos_p)[0] & 0x80;
+	}
+	int ret = hpack_feed_int(ds, 7, in_pos_p, in_end);
+	if (ret <= 0) {
+		return ret;
+	}
+
+	ds->str_left = ds->int_value;
+	ds->str_in = 0;
+	ds->str_len = 0;
+	huffman_decoder_init(&ds->huffman);
+	if (hpack_decode_buffer(hpack, which, 1) == NULL) {
+		return HPERR_NOMEM;
+	}
+	return 1;
+}
+
+/* Decode a field byte by byte, keeping the state in hpack->decode_state
+ * between calls. Strings are copied into the decode buffers.
+ * Return 1 for a header, 0 for a dynamic table size update or if more
+ * input is needed, or negetive error code if fail. */
+static int hpack_decode_feed_field(hpack_t *hpack, const uint8_t **in_pos_p,
+		const uint8_t *in_end, int max_list_size, struct hpack_header *header)
+{
+	struct hpack_decode_state *ds = &hpack->decode_state;
+	int ret;
+
+	header->value_huffman = false;
+	header->never_indexed = false;
+	while (*in_pos_p < in_end) {
+		switch (ds->step) {
+		case HPACK_FEED_FIRST:
+			ds->first = (*in_pos_p)[0];
+			ds->step = HPACK_FEED_INDEX;
+			break;
+
+		case HPACK_FEED_INDEX:
+			{
+			int prefix_bits = (ds->first & 0x80) ? 7 : (ds->first & 0x40) ? 6
+					: (ds->first & 0x20) ? 5 : 4;
+			ret = hpack_feed_int(ds, prefix_bits, in_pos_p, in_end);
+			if (ret <= 0) {
+				return ret;
+			}
+			ds->step = HPACK_FEED_FIRST;
+
+			/* -- Indexed Header Field */
+			if (ds->first & 0x80) {
+				ret = hpack_get(hpack, ds->int_value, &header->name_str,
+						&header->name_len, &header->token,
+						&header->value_str, &header->value_len);
+				if (ret < 0) {
+					return ret;
+				}
+				hpack_decode_count(hpack, ds->first, ds->int_value, header);
+				return 1;
+			}
+
+			/* -- Dynamic Table Size Update */
+			if ((ds->first & 0x40) == 0 && (ds->first & 0x20)) {
+				ret = hpack_dynamic_max_size(hpack, ds->int_value);
+				return ret < 0 ? ret : 0;
+			}
+
+			/* -- Literal Header Field */
+			ds->name_index = ds->int_value;
+			ds->name_len = 0;
+			if (ds->name_index != 0) {
+				/* the name length, to bound the buffering of value */
+				const char *name_str;
+				int token;
+				ret = hpack_get(hpack, ds->name_index, &name_str,
+						&ds->name_len, &token, NULL, NULL);
+				if (ret < 0) {
+					return ret;
+				}
+			}
+			ds->step = (ds->name_index == 0) ? HPACK_FEED_NAME_LEN : HPACK_FEED_VALUE_LEN;
+			}
+			break;
+
+		case HPACK_FEED_NAME_LEN:
+		case HPACK_FEED_VALUE_LEN:
+			{
+			int which = (ds->step == HPACK_FEED_NAME_LEN) ? 0 : 1;
+			ret = hpack_feed_string_len(hpack, which, in_pos_p, in_end);
+			if (ret <= 0) {
+				return ret;
+			}
+			ds->step++;
+			}
+			/* go through, since the string may be empty */
+
+		case HPACK_FEED_NAME:
+		case HPACK_FEED_VALUE:
+			{
+			int which = (ds->step == HPACK_FEED_NAME) ? 0 : 1;
+			ret = hpack_feed_string(hpack, which, in_pos_p, in_end);
+			if (ret < 0) {
+				return ret;
+			}
+
+			/* bound the buffering, see RFC 7540 Section 6.5.2 */
+			if (max_list_size > 0 && ds->list_size + ds->name_len
+					+ ds->str_len + 32 > max_list_size) {
+				return HPERR_HEADER_LIST_TOO_LONG;
+			}
+			if (ret == 0) {
+				return 0;
+			}
+
+			if (which == 0) {
+				ds->name_len = ds->str_len;
+				ds->step = HPACK_FEED_VALUE_LEN;
+				break;
+			}
+			}
+
+			/* the value is done, and so is the field */
+			ds->step = HPACK_FEED_FIRST;
+			header->never_indexed = (ds->first & 0xf0) == 0x10;
+			if (ds->name_index == 0) {
+				header->name_str = hpack->decode_bufs[0];
+				header->name_len = ds->name_len;
+				header->token = hpack_name_token(header->name_str, header->name_len);
+			} else {
+				ret = hpack_get(hpack, ds->name_index, &header->name_str,
+						&header->name_len, &header->token, NULL, NULL);
+				if (ret < 0) {
+					return ret;
+				}
+			}
+			header->value_str = hpack->decode_bufs[1];
+			header->value_len = ds->str_len;
+
+			/* add to dynamic table */
+			if (ds->first & 0x40) {
+				ret = hpack_dynamic_add(hpack, header->name_str, header->name_len,
+						header->value_str, header->value_len, header->token);
+				if (ret == HPERR_NOMEM) {
+					return ret;
+				}
+
+				/* the name may be in an evicted entry, so use the new one */
+				if (ret == 0 && ds->name_index > HPACK_STATIC_TABLE_SIZE) {
+					hpack_get(hpack, HPACK_STATIC_TABLE_SIZE + 1,
+							&header->name_str, &header->name_len,
+							&header->token, NULL, NULL);
+				}
+			}
+			hpack_decode_count(hpack, ds->first, ds->name_index, header);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int hpack_decode_block_feed(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, bool end_block,
+		int max_list_size, hpack_header_f handler, void *data)
+{
+	struct hpack_decode_state *ds = &hpack->decode_state;
+	const uint8_t *in_pos = in_buf;
+	int ret;
+
+	HPACK_STATS_ADD(hpack, coded_bytes, in_end - in_buf);
+	while (in_pos < in_end) {
+		struct hpack_header header;
+		if (ds->step == HPACK_FEED_FIRST) {
+			/* fast path, for the field in whole input */
+			const uint8_t *field_pos = in_pos;
+			ret = hpack_decode_field(hpack, &in_pos, in_end, &header,
+					hpack->lazy_huffman);
+			if (ret == HPERR_AGAIN) {
+				in_pos = field_pos;
+				ret = hpack_decode_feed_field(hpack, &in_pos, in_end,
+						max_list_size, &header);
+			}
+		} else {
+			ret = hpack_decode_feed_field(hpack, &in_pos, in_end,
+					max_list_size, &header);
+		}
+		if (ret < 0) {
+			goto fail;
+		}
+		if (ret == 0) { /* dynamic table size update, or input ends */
+			continue;
+		}
+
+		/* see RFC 7540 Section 6.5.2, with the upper bound of lazy value */
+		ds->list_size += header.name_len + 32 + (header.value_huffman
+				? HPACK_HUFFMAN_DECODED_MAX_LEN(header.value_len) : header.value_len);
+		if (max_list_size > 0 && ds->list_size > max_list_size) {
+			ret = HPERR_HEADER_LIST_TOO_LONG;
+			goto fail;
+		}
+
+		ret = handler(data, &header);
+		if (ret != 0) {
+			goto fail;
+		}
+	}
+
+	if (end_block) {
+		ret = (ds->step == HPACK_FEED_FIRST) ? 0 : HPERR_AGAIN;
+		goto fail;
+	}
+	return 0;
+
+fail: /* and end of block */
+	bzero(ds, sizeof(struct hpack_decode_state));
+	return ret;
+}
+
+int hpack_decode_block(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		hpack_header_f handler, void *data)
+{
+	return hpack_decode_block_feed(hpack, in_buf, in_end, true,
+			max_list_size, handler, data);
+}
+
+struct hpack_decode_array {
+	struct hpack_header	*headers;
+	int			count;
+	int			max_headers;
+
+	const uint8_t		*in_buf;
+	const uint8_t		*in_end;
+	char			*str_pos;
+	char			*str_end;
+
+	int			error;	/* HPERR_NO_SPACE if out of space */
+};
+
+/* strings in input buffer stay, while others are copied out */
+static const char *hpack_decode_array_keep(struct hpack_decode_array *da,
+		const char *str, int len)
+{
+	if (str == NULL || (str >= (const char *)da->in_buf && str < (const char *)da->in_end)) {
+		return str;
+	}
+	if (da->str_end - da->str_pos < len) {
+		return NULL;
+	}
+	char *copy = da->str_pos;
+	memcpy(copy, str, len);
+	da->str_pos += len;
+	return copy;
+}
+
+static int hpack_decode_array_handler(void *data, const struct hpack_header *header)
+{
+	struct hpack_decode_array *da = data;
+
+	/* go on decoding without storing, to keep the dynamic table in sync */
+	if (da->error != 0) {
+		return 0;
+	}
+	if (da->count == da->max_headers) {
+		da->error = HPERR_NO_SPACE;
+		return 0;
+	}
+
+	struct hpack_header *h = &da->headers[da->count];
+	*h = *header;
+	h->name_str = hpack_decode_array_keep(da, header->name_str, header->name_len);
+	h->value_str = hpack_decode_array_keep(da, header->value_str, header->value_len);
+	if (h->name_str == NULL || (h->value_str == NULL && header->value_str != NULL)) {
+		da->error = HPERR_NO_SPACE;
+		return 0;
+	}
+
+	da->count++;
+	return 0;
+}
+
+int hpack_decode_block_array(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		struct hpack_header *headers, int max_headers,
+		char *str_buf, char *str_end)
+{
+	struct hpack_decode_array da = {
+		.headers = headers,
+		.max_headers = max_headers,
+		.in_buf = in_buf,
+		.in_end = in_end,
+		.str_pos = str_buf,
+		.str_end = str_end,
+	};
+
+	int ret = hpack_decode_block(hpack, in_buf, in_end, max_list_size,
+			hpack_decode_array_handler, &da);
+	if (ret < 0) {
+		return ret;
+	}
+	if (da.error != 0) {
+		return da.error;
+	}
+	return da.count;
+}
+
+void hpack_decode_lazy_huffman(hpack_t *hpack, bool lazy)
+{
+	hpack->lazy_huffman = lazy;
+}
+
+int hpack_header_value(const struct hpack_header *header,
+		char *out_buf, char *out_end)
+{
+	if (!header->value_huffman) {
+		if (out_end - out_buf < header->value_len) {
+			return HPERR_NO_SPACE;
+		}
+		if (header->value_len > 0) {
+			memcpy(out_buf, header->value_str, header->value_len);
+		}
+		return header->value_len;
+	}
+
+	struct huffman_decoder hd;
+	huffman_decoder_init(&hd);
+	const uint8_t *in_pos = (const uint8_t *)header->value_str;
+	const uint8_t *in_end = in_pos + header->value_len;
+	int len = huffman_decoder_feed(&hd, &in_pos, in_end, out_buf, out_end - out_buf);
+	if (len < 0) {
+		return HPERR_HUFFMAN;
+	}
+	if (in_pos != in_end) {
+		return HPERR_NO_SPACE;
+	}
+	if (!huffman_decoder_finish(&hd)) {
+		return HPERR_HUFFMAN;
+	}
+	return len;
+}
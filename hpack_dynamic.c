@@ -1,144 +1,778 @@
 #include <stdlib.h>
 #include <string.h>
-#include <stdlib.h>
+#include <strings.h>
 
 #include "hpack.h"
+#include "hpack_static.h"
 #include "hpack_dynamic.h"
 
-#define HPACK_DYNAMIC_EXTRA_SIZE	32	/* see RFC 7541 Section 4.1 */
-#define HPACK_DYNAMIC_INDEX_BEGIN	61	/* static table size */
+#define HPACK_DYNAMIC_INDEX_BEGIN	HPACK_STATIC_TABLE_SIZE
 
-struct hpack_dynamic_entry {
-	short		name_len;
-	short		value_len;
-	char		data[0];
-};
+#define HPACK_DYNAMIC_DATA_MIN		256
+#define HPACK_DYNAMIC_ENTRY_MIN		16	/* power of 2 */
 
-struct hpack_s {
-	int		buf_max;
-	int		buf_used;
+static inline int hpack_dynamic_count(hpack_t *hpack)
+{
+	return hpack->insert_count - hpack->evict_count;
+}
 
-	int		index_size;
-	int		index_used;
+static inline struct hpack_dynamic_entry *hpack_dynamic_entry(hpack_t *hpack, uint32_t id)
+{
+	return &hpack->entries[id & (hpack->entry_size - 1)];
+}
 
-	struct hpack_dynamic_entry **indexs;
-};
+static inline struct hpack_dynamic_link *hpack_dynamic_link(hpack_t *hpack, uint32_t id)
+{
+	return &hpack->links[id & (hpack->entry_size - 1)];
+}
+
+static inline int hpack_dynamic_data_used(hpack_t *hpack)
+{
+	return hpack->buf_used - hpack_dynamic_count(hpack) * HPACK_DYNAMIC_EXTRA_SIZE;
+}
+
+/* copy data from the ring at @offset into linear @dest */
+static void hpack_dynamic_ring_read(hpack_t *hpack, int offset, char *dest, int len)
+{
+	int first = hpack->data_size - offset;
+	if (len == 0) {
+		return;
+	} else if (len <= first) {
+		memcpy(dest, hpack->data + offset, len);
+	} else {
+		memcpy(dest, hpack->data + offset, first);
+		memcpy(dest + first, hpack->data, len - first);
+	}
+}
+
+/* copy linear @src into the ring at @offset, and return the next offset.
+ * @src may be an evicted entry in the ring which is just behind @offset,
+ * so copy forward by memmove. */
+static int hpack_dynamic_ring_write(hpack_t *hpack, int offset, const char *src, int len)
+{
+	int first = hpack->data_size - offset;
+	if (len < first) {
+		memmove(hpack->data + offset, src, len);
+		return offset + len;
+	} else {
+		memmove(hpack->data + offset, src, first);
+		memmove(hpack->data, src + first, len - first);
+		return len - first;
+	}
+}
+
+/* Grow the string ring to hold @need bytes in all, with live entries moved
+ * to the beginning. The old ring is returned in @old_data_p and should be
+ * freed by caller after copying the new entry, which may refer to it. */
+static int hpack_dynamic_data_grow(hpack_t *hpack, int need, char **old_data_p)
+{
+	int size = hpack->data_size * 2;
+	if (size < HPACK_DYNAMIC_DATA_MIN) {
+		size = HPACK_DYNAMIC_DATA_MIN;
+	}
+	if (size > hpack->buf_max) {
+		size = hpack->buf_max;
+	}
+	if (size < need) {
+		size = need;
+	}
+
+	char *data = hpack_mem_alloc(hpack, size);
+	if (data == NULL) {
+		return HPERR_NOMEM;
+	}
+
+	int offset = 0;
+	uint32_t id;
+	for (id = hpack->evict_count; id != hpack->insert_count; id++) {
+		struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, id);
+		int len = de->name_len + de->value_len;
+		hpack_dynamic_ring_read(hpack, de->offset, data + offset, len);
+		de->offset = offset;
+		offset += len;
+	}
+
+	*old_data_p = hpack->data;
+	hpack->data = data;
+	hpack->data_size = size;
+	hpack->data_tail = offset;
+	return 0;
+}
+
+static uint32_t hpack_dynamic_hash(uint32_t hash, const char *str, int len)
+{
+	/* FNV-1a */
+	int i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (uint8_t)str[i]) * 16777619;
+	}
+	return hash;
+}
+
+#define HPACK_DYNAMIC_HASH_INIT		2166136261u
+
+static inline bool hpack_dynamic_id_valid(hpack_t *hpack, uint32_t id)
+{
+	return hpack->insert_count - id - 1 < (uint32_t)hpack_dynamic_count(hpack);
+}
+
+static uint32_t hpack_dynamic_ring_hash(hpack_t *hpack, uint32_t hash, int offset, int len)
+{
+	int first = hpack->data_size - offset;
+	if (len <= first) {
+		return hpack_dynamic_hash(hash, hpack->data + offset, len);
+	}
+	hash = hpack_dynamic_hash(hash, hpack->data + offset, first);
+	return hpack_dynamic_hash(hash, hpack->data, len - first);
+}
+
+static void hpack_dynamic_index_link(hpack_t *hpack, uint32_t id)
+{
+	struct hpack_dynamic_link *dl = hpack_dynamic_link(hpack, id);
+	uint32_t mask = hpack->entry_size - 1;
+
+	dl->name_next = hpack->name_buckets[dl->name_hash & mask];
+	hpack->name_buckets[dl->name_hash & mask] = id;
+	dl->next = hpack->buckets[dl->hash & mask];
+	hpack->buckets[dl->hash & mask] = id;
+}
+
+/* (re)build the encoder index for entry_size buckets */
+static int hpack_dynamic_index_build(hpack_t *hpack)
+{
+	size_t size = sizeof(uint32_t) * hpack->entry_size;
+	uint32_t *name_buckets = hpack_mem_realloc(hpack, hpack->name_buckets, size);
+	if (name_buckets == NULL) {
+		return HPERR_NOMEM;
+	}
+	hpack->name_buckets = name_buckets;
+	uint32_t *buckets = hpack_mem_realloc(hpack, hpack->buckets, size);
+	if (buckets == NULL) {
+		return HPERR_NOMEM;
+	}
+	hpack->buckets = buckets;
+
+	/* UINT32_MAX is never a valid id */
+	memset(hpack->name_buckets, 0xff, size);
+	memset(hpack->buckets, 0xff, size);
+
+	uint32_t id;
+	for (id = hpack->evict_count; id != hpack->insert_count; id++) {
+		hpack_dynamic_index_link(hpack, id);
+	}
+	return 0;
+}
+
+/* create the encoder index, with hashes of entries in the table */
+static int hpack_dynamic_index_init(hpack_t *hpack)
+{
+	struct hpack_dynamic_link *links = hpack_mem_realloc(hpack, hpack->links,
+			sizeof(struct hpack_dynamic_link) * hpack->entry_size);
+	if (links == NULL) {
+		return HPERR_NOMEM;
+	}
+	hpack->links = links;
+
+	uint32_t id;
+	for (id = hpack->evict_count; id != hpack->insert_count; id++) {
+		struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, id);
+		struct hpack_dynamic_link *dl = hpack_dynamic_link(hpack, id);
+		dl->name_hash = hpack_dynamic_ring_hash(hpack, HPACK_DYNAMIC_HASH_INIT,
+				de->offset, de->name_len);
+		int value_offset = de->offset + de->name_len;
+		if (value_offset >= hpack->data_size) {
+			value_offset -= hpack->data_size;
+		}
+		dl->hash = hpack_dynamic_ring_hash(hpack, dl->name_hash,
+				value_offset, de->value_len);
+	}
+	return hpack_dynamic_index_build(hpack);
+}
 
-static int hpack_dynamic_index_increase(hpack_t *hpack)
+static int hpack_dynamic_entry_grow(hpack_t *hpack)
 {
-	if (hpack->indexs == NULL || hpack->index_used == hpack->index_size) {
-		hpack->index_size *= 2;
-		hpack->indexs = realloc(hpack->indexs,
-				sizeof(struct hpack_dynamic_entry *) * hpack->index_size);
-		if (hpack->indexs == NULL) {
+	int size = hpack->entry_size * 2;
+	if (size < HPACK_DYNAMIC_ENTRY_MIN) {
+		size = HPACK_DYNAMIC_ENTRY_MIN;
+	}
+
+	struct hpack_dynamic_entry *entries = hpack_mem_alloc(hpack,
+			sizeof(struct hpack_dynamic_entry) * size);
+	if (entries == NULL) {
+		return HPERR_NOMEM;
+	}
+	struct hpack_dynamic_link *links = NULL;
+	if (hpack->links != NULL) {
+		links = hpack_mem_alloc(hpack, sizeof(struct hpack_dynamic_link) * size);
+		if (links == NULL) {
+			hpack_mem_free(hpack, entries);
 			return HPERR_NOMEM;
 		}
 	}
 
-	hpack->index_used++;
+	uint32_t id;
+	for (id = hpack->evict_count; id != hpack->insert_count; id++) {
+		entries[id & (size - 1)] = *hpack_dynamic_entry(hpack, id);
+		if (links != NULL) {
+			links[id & (size - 1)] = *hpack_dynamic_link(hpack, id);
+		}
+	}
+
+	hpack_mem_free(hpack, hpack->entries);
+	hpack_mem_free(hpack, hpack->links);
+	hpack->entries = entries;
+	hpack->links = links;
+	hpack->entry_size = size;
+
+	if (hpack->buckets != NULL) {
+		return hpack_dynamic_index_build(hpack);
+	}
 	return 0;
 }
 
 static int hpack_dynamic_table_size_adjust(hpack_t *hpack, int length)
 {
+	/* see RFC 7541 Section 4.4 */
 	if (length > hpack->buf_max) {
+		HPACK_STATS_ADD(hpack, evicts, hpack_dynamic_count(hpack));
+		hpack->evict_count = hpack->insert_count;
+		hpack->buf_used = 0;
+		hpack->data_tail = 0;
 		return HPERR_DYN_ENTRY_TOO_LONG;
 	}
 
-	int n = 0;
 	while (hpack->buf_used + length > hpack->buf_max) {
-		struct hpack_dynamic_entry *de = hpack->indexs[n++];
+		struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, hpack->evict_count++);
 		hpack->buf_used -= de->name_len + de->value_len + HPACK_DYNAMIC_EXTRA_SIZE;
-		free(de);
+		HPACK_STATS_ADD(hpack, evicts, 1);
 	}
 
-	if (n != 0) {
-		hpack->index_used -= n;
-		memmove(hpack->indexs, hpack->indexs + n,
-				sizeof(struct hpack_dynamic_entry *) * hpack->index_used);
+	/* start over to avoid wrapping */
+	if (hpack_dynamic_count(hpack) == 0) {
+		hpack->data_tail = 0;
 	}
 
 	return 0;
 }
 
-int hpack_max_size(hpack_t *hpack, int max_size)
+static int hpack_dynamic_resize(hpack_t *hpack, int max_size)
 {
 	if (max_size < 0) {
 		return max_size;
 	}
+	if (hpack->fixed && max_size > hpack->data_size) {
+		return HPERR_NOMEM;
+	}
 	hpack->buf_max = max_size;
+	HPACK_STATS_ADD(hpack, size_updates, 1);
 	return hpack_dynamic_table_size_adjust(hpack, 0);
 }
 
+int hpack_dynamic_max_size(hpack_t *hpack, int max_size)
+{
+	/* see RFC 7541 Section 6.3 */
+	if (max_size > hpack->buf_limit) {
+		return HPERR_INVALID_SIZE_UPDATE;
+	}
+	return hpack_dynamic_resize(hpack, max_size);
+}
+
+int hpack_max_size(hpack_t *hpack, int max_size)
+{
+	int ret = hpack_dynamic_resize(hpack, max_size);
+	if (ret < 0) {
+		return ret;
+	}
+	hpack->buf_limit = max_size;
+
+	/* the smallest and the final sizes are to be emitted at the
+	 * beginning of the next block, see RFC 7541 Section 4.2 */
+	if (!hpack->size_update || max_size < hpack->size_update_min) {
+		hpack->size_update_min = max_size;
+	}
+	hpack->size_update = true;
+	return 0;
+}
+
 int hpack_dynamic_add(hpack_t *hpack, const char *name_str, int name_len,
-		const char *value_str, int value_len)
+		const char *value_str, int value_len, int token)
 {
-	/* increase index */
+	/* evict */
 	int buf_length = value_len + name_len + HPACK_DYNAMIC_EXTRA_SIZE;
 	int ret = hpack_dynamic_table_size_adjust(hpack, buf_length);
 	if (ret < 0) {
 		return ret;
 	}
 
-	ret = hpack_dynamic_index_increase(hpack);
-	if (ret < 0) {
-		return ret;
+	/* make room, which happens only before the table gets full */
+	if (hpack_dynamic_count(hpack) == hpack->entry_size) {
+		ret = hpack_dynamic_entry_grow(hpack);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	char *old_data = NULL;
+	int data_need = hpack_dynamic_data_used(hpack) + name_len + value_len;
+	if (data_need > hpack->data_size) {
+		ret = hpack_dynamic_data_grow(hpack, data_need, &old_data);
+		if (ret < 0) {
+			return ret;
+		}
 	}
 
 	/* add entry */
-	struct hpack_dynamic_entry *de = malloc(sizeof(struct hpack_dynamic_entry)
-			+ name_len + value_len);
-	if (de == NULL) {
-		return HPERR_NOMEM;
-	}
+	struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, hpack->insert_count++);
+	HPACK_STATS_ADD(hpack, inserts, 1);
+	de->offset = hpack->data_tail;
 	de->name_len = name_len;
 	de->value_len = value_len;
-	memcpy(de->data, name_str, name_len);
-	memcpy(de->data + name_len, value_str, value_len);
+	de->token = token;
+	if (hpack->buckets != NULL) { /* before the ring is written */
+		struct hpack_dynamic_link *dl = hpack_dynamic_link(hpack, hpack->insert_count - 1);
+		dl->name_hash = hpack_dynamic_hash(HPACK_DYNAMIC_HASH_INIT, name_str, name_len);
+		dl->hash = hpack_dynamic_hash(dl->name_hash, value_str, value_len);
+	}
+	if (name_len + value_len > 0) {
+		int offset = hpack_dynamic_ring_write(hpack, hpack->data_tail, name_str, name_len);
+		hpack->data_tail = hpack_dynamic_ring_write(hpack, offset, value_str, value_len);
+	}
+
+	if (hpack->buckets != NULL) {
+		hpack_dynamic_index_link(hpack, hpack->insert_count - 1);
+	}
+
+	hpack_mem_free(hpack, old_data);
 
-	hpack->indexs[hpack->index_used - 1] = de;
 	hpack->buf_used += buf_length;
 	return 0;
 }
 
-bool hpack_dynamic_decode(hpack_t *hpack, int index,
-		const char **name_str, int *name_len,
+static bool hpack_dynamic_ring_equal(hpack_t *hpack, int offset, const char *str, int len)
+{
+	int first = hpack->data_size - offset;
+	if (len == 0) {
+		return true;
+	} else if (len <= first) {
+		return memcmp(hpack->data + offset, str, len) == 0;
+	}
+	return memcmp(hpack->data + offset, str, first) == 0
+			&& memcmp(hpack->data, str + first, len - first) == 0;
+}
+
+/* Return the index if both name and value match, or 0 and set
+ * @name_index if only name matches, or 0 if none. */
+/* look up by scanning all entries, from the newest */
+static int hpack_dynamic_encode_scan(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index)
+{
+	uint32_t id;
+	for (id = hpack->insert_count - 1; hpack_dynamic_id_valid(hpack, id); id--) {
+		struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, id);
+		if (de->name_len != name_len
+				|| !hpack_dynamic_ring_equal(hpack, de->offset, name_str, name_len)) {
+			continue;
+		}
+		int index = hpack->insert_count - id + HPACK_DYNAMIC_INDEX_BEGIN;
+		if (*name_index == 0) {
+			*name_index = index;
+		}
+		if (value_str == NULL) { /* name only */
+			break;
+		}
+		int value_offset = de->offset + name_len;
+		if (value_offset >= hpack->data_size) {
+			value_offset -= hpack->data_size;
+		}
+		if (de->value_len == value_len
+				&& hpack_dynamic_ring_equal(hpack, value_offset, value_str, value_len)) {
+			return index;
+		}
+	}
+	return 0;
+}
+
+int hpack_dynamic_encode(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index)
+{
+	*name_index = 0;
+
+	if (hpack->buckets == NULL) {
+		if (hpack->fixed) { /* no room for the index */
+			return hpack_dynamic_encode_scan(hpack, name_str, name_len,
+					value_str, value_len, name_index);
+		}
+		if (hpack->entry_size == 0 && hpack_dynamic_entry_grow(hpack) < 0) {
+			return 0;
+		}
+		if (hpack_dynamic_index_init(hpack) < 0) {
+			return 0;
+		}
+	}
+
+	uint32_t mask = hpack->entry_size - 1;
+	uint32_t name_hash = hpack_dynamic_hash(HPACK_DYNAMIC_HASH_INIT, name_str, name_len);
+
+	uint32_t id;
+	uint32_t hash = 0;
+	if (value_str != NULL) {
+		hash = hpack_dynamic_hash(name_hash, value_str, value_len);
+		id = hpack->buckets[hash & mask];
+	} else { /* name only */
+		id = UINT32_MAX;
+	}
+	for (; hpack_dynamic_id_valid(hpack, id);
+			id = hpack_dynamic_link(hpack, id)->next) {
+		struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, id);
+		if (hpack_dynamic_link(hpack, id)->hash != hash
+				|| de->name_len != name_len || de->value_len != value_len) {
+			continue;
+		}
+		int value_offset = de->offset + name_len;
+		if (value_offset >= hpack->data_size) {
+			value_offset -= hpack->data_size;
+		}
+		if (hpack_dynamic_ring_equal(hpack, de->offset, name_str, name_len)
+				&& hpack_dynamic_ring_equal(hpack, value_offset, value_str, value_len)) {
+			return hpack->insert_count - id + HPACK_DYNAMIC_INDEX_BEGIN;
+		}
+	}
+
+	for (id = hpack->name_buckets[name_hash & mask]; hpack_dynamic_id_valid(hpack, id);
+			id = hpack_dynamic_link(hpack, id)->name_next) {
+		struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, id);
+		if (hpack_dynamic_link(hpack, id)->name_hash == name_hash && de->name_len == name_len
+				&& hpack_dynamic_ring_equal(hpack, de->offset, name_str, name_len)) {
+			*name_index = hpack->insert_count - id + HPACK_DYNAMIC_INDEX_BEGIN;
+			break;
+		}
+	}
+	return 0;
+}
+
+int hpack_dynamic_dry_encode(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index)
+{
+	struct hpack_dynamic_dry *dry = hpack->dry;
+	*name_index = 0;
+
+	/* inserted in the block, which are newer than the table */
+	int index = HPACK_DYNAMIC_INDEX_BEGIN;
+	int i;
+	for (i = dry->current - 1; i >= dry->first; i--) {
+		const struct hpack_header *h = &dry->headers[i];
+		if (!dry->inserted[i]) {
+			continue;
+		}
+		index++;
+		if (h->name_len != name_len || strncasecmp(h->name_str, name_str, name_len) != 0) {
+			continue;
+		}
+		if (*name_index == 0) {
+			*name_index = index;
+		}
+		if (value_str != NULL && h->value_len == value_len
+				&& memcmp(h->value_str, value_str, value_len) == 0) {
+			return index;
+		}
+	}
+
+	/* the table, without the oldest entries evicted in the block */
+	int live = hpack->insert_count - dry->evict_count;
+	int table_name_index;
+	index = hpack_dynamic_encode(hpack, name_str, name_len,
+			value_str, value_len, &table_name_index);
+	if (index > 0) {
+		if (index - HPACK_DYNAMIC_INDEX_BEGIN <= live) {
+			return index + dry->live;
+		}
+		/* evicted, while a newer entry may match the name */
+		hpack_dynamic_encode(hpack, name_str, name_len, NULL, 0, &table_name_index);
+	}
+	if (*name_index == 0 && table_name_index > 0
+			&& table_name_index - HPACK_DYNAMIC_INDEX_BEGIN <= live) {
+		*name_index = table_name_index + dry->live;
+	}
+	return 0;
+}
+
+void hpack_dynamic_dry_add(hpack_t *hpack, int name_len, int value_len)
+{
+	struct hpack_dynamic_dry *dry = hpack->dry;
+	int length = name_len + value_len + HPACK_DYNAMIC_EXTRA_SIZE;
+
+	/* as hpack_dynamic_table_size_adjust() */
+	if (length > hpack->buf_max) {
+		dry->evict_count = hpack->insert_count;
+		dry->first = dry->current;
+		dry->live = 0;
+		dry->buf_used = 0;
+		return;
+	}
+	while (dry->buf_used + length > hpack->buf_max) {
+		if (dry->evict_count != hpack->insert_count) {
+			struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack, dry->evict_count++);
+			dry->buf_used -= de->name_len + de->value_len + HPACK_DYNAMIC_EXTRA_SIZE;
+		} else {
+			while (!dry->inserted[dry->first]) {
+				dry->first++;
+			}
+			const struct hpack_header *h = &dry->headers[dry->first++];
+			dry->buf_used -= h->name_len + h->value_len + HPACK_DYNAMIC_EXTRA_SIZE;
+			dry->live--;
+		}
+	}
+
+	dry->inserted[dry->current] = 1;
+	dry->live++;
+	dry->buf_used += length;
+}
+
+char *hpack_decode_buffer(hpack_t *hpack, int which, int size)
+{
+	if (size > hpack->decode_buf_sizes[which]) {
+		char *buf = hpack_mem_realloc(hpack, hpack->decode_bufs[which], size);
+		if (buf == NULL) {
+			return NULL;
+		}
+		hpack->decode_bufs[which] = buf;
+		hpack->decode_buf_sizes[which] = size;
+	}
+	return hpack->decode_bufs[which];
+}
+
+/* return string in the ring, or its copy if it wraps */
+static const char *hpack_dynamic_string(hpack_t *hpack, int which, int offset, int len)
+{
+	if (len == 0) {
+		return "";
+	}
+	if (offset + len <= hpack->data_size) {
+		return hpack->data + offset;
+	}
+
+	char *buf = hpack_decode_buffer(hpack, which, len);
+	if (buf == NULL) {
+		return NULL;
+	}
+	hpack_dynamic_ring_read(hpack, offset, buf, len);
+	return buf;
+}
+
+int hpack_dynamic_decode(hpack_t *hpack, int index,
+		const char **name_str, int *name_len, int *token,
 		const char **value_str, int *value_len)
 {
-	if (index <= HPACK_DYNAMIC_INDEX_BEGIN || index > hpack->index_used + HPACK_DYNAMIC_INDEX_BEGIN) {
-		return false;
+	if (index <= HPACK_DYNAMIC_INDEX_BEGIN || index > hpack_dynamic_count(hpack) + HPACK_DYNAMIC_INDEX_BEGIN) {
+		return HPERR_INVALID_DYNAMIC_INDEX;
 	}
 
-	struct hpack_dynamic_entry *de = hpack->indexs[hpack->index_used + HPACK_DYNAMIC_INDEX_BEGIN - index];
-	*name_str = de->data;
+	struct hpack_dynamic_entry *de = hpack_dynamic_entry(hpack,
+			hpack->insert_count + HPACK_DYNAMIC_INDEX_BEGIN - index);
+	*name_str = hpack_dynamic_string(hpack, 0, de->offset, de->name_len);
 	*name_len = de->name_len;
+	*token = de->token;
+	if (*name_str == NULL) {
+		return HPERR_NOMEM;
+	}
 	if (value_str != NULL) {
-		*value_str = de->data + de->name_len;
+		int offset = de->offset + de->name_len;
+		if (offset >= hpack->data_size) {
+			offset -= hpack->data_size;
+		}
+		*value_str = hpack_dynamic_string(hpack, 1, offset, de->value_len);
 		*value_len = de->value_len;
+		if (*value_str == NULL) {
+			return HPERR_NOMEM;
+		}
 	}
-	return true;
+	return 0;
 }
 
+void hpack_get_stats(hpack_t *hpack, struct hpack_stats *stats)
+{
+#ifdef HPACK_STATS
+	*stats = hpack->stats;
+#else
+	bzero(stats, sizeof(struct hpack_stats));
+#endif
+	stats->table_entries = hpack_dynamic_count(hpack);
+	stats->table_size = hpack->buf_used;
+	stats->table_max_size = hpack->buf_max;
+}
 
-hpack_t *hpack_new(int buf_max)
+
+static void *hpack_libc_alloc(void *data, size_t size)
 {
-	hpack_t *hpack = malloc(sizeof(hpack_t));
+	return malloc(size);
+}
+
+static void *hpack_libc_realloc(void *data, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void hpack_libc_free(void *data, void *ptr)
+{
+	free(ptr);
+}
+
+static const struct hpack_allocator hpack_libc_allocator = {
+	.alloc = hpack_libc_alloc,
+	.realloc = hpack_libc_realloc,
+	.free = hpack_libc_free,
+};
+
+hpack_t *hpack_new_ex(int buf_max, const struct hpack_allocator *allocator)
+{
+	if (allocator == NULL) {
+		allocator = &hpack_libc_allocator;
+	}
+
+	hpack_t *hpack = allocator->alloc(allocator->data, sizeof(hpack_t));
 	if (hpack == NULL) {
 		return NULL;
 	}
 
 	bzero(hpack, sizeof(hpack_t));
 	hpack->buf_max = buf_max;
-	hpack->index_size = 16;
+	hpack->buf_limit = buf_max;
+	hpack->allocator = *allocator;
 	return hpack;
 }
 
-void hpack_free(hpack_t *hpack)
+hpack_t *hpack_new(int buf_max)
 {
-	int i;
-	for (i = 0; i < hpack->index_used; i++) {
-		free(hpack->indexs[i]);
+	return hpack_new_ex(buf_max, NULL);
+}
+
+/* fixed-capacity context, see hpack_init() */
+
+#define HPACK_FIXED_ALIGN(n)		(((n) + 15) & ~(size_t)15)
+
+struct hpack_fixed_layout {
+	int		entry_size;
+
+	/* offsets in the memory */
+	size_t		entries;
+	size_t		data;
+	size_t		buckets;
+	size_t		links;
+
+	size_t		size;		/* without the encoder index */
+	size_t		index_size;	/* with the encoder index */
+};
+
+static void hpack_fixed_layout(int max_size, struct hpack_fixed_layout *layout)
+{
+	/* each entry takes HPACK_DYNAMIC_EXTRA_SIZE at least, so the table
+	 * never gets more entries than this, and hpack_dynamic_entry_grow()
+	 * is never called */
+	int entry_size = HPACK_DYNAMIC_ENTRY_MIN;
+	while (entry_size < max_size / HPACK_DYNAMIC_EXTRA_SIZE) {
+		entry_size *= 2;
 	}
-	free(hpack->indexs);
-	free(hpack);
+	layout->entry_size = entry_size;
+
+	layout->entries = HPACK_FIXED_ALIGN(sizeof(hpack_t));
+	layout->data = layout->entries + sizeof(struct hpack_dynamic_entry) * entry_size;
+	layout->size = HPACK_FIXED_ALIGN(layout->data + max_size);
+	layout->buckets = layout->size;
+	layout->links = layout->buckets + sizeof(uint32_t) * entry_size * 2;
+	layout->index_size = layout->links + sizeof(struct hpack_dynamic_link) * entry_size;
+}
+
+static void *hpack_fixed_alloc(void *data, size_t size)
+{
+	return NULL;
+}
+
+static void *hpack_fixed_realloc(void *data, void *ptr, size_t size)
+{
+	return NULL;
+}
+
+static void hpack_fixed_free(void *data, void *ptr)
+{
+}
+
+static const struct hpack_allocator hpack_fixed_allocator = {
+	.alloc = hpack_fixed_alloc,
+	.realloc = hpack_fixed_realloc,
+	.free = hpack_fixed_free,
+};
+
+size_t hpack_context_size(int max_size)
+{
+	struct hpack_fixed_layout layout;
+	hpack_fixed_layout(max_size < 0 ? 0 : max_size, &layout);
+	return layout.size;
+}
+
+size_t hpack_encoder_context_size(int max_size)
+{
+	struct hpack_fixed_layout layout;
+	hpack_fixed_layout(max_size < 0 ? 0 : max_size, &layout);
+	return layout.index_size;
+}
+
+hpack_t *hpack_init(void *mem, size_t mem_size, int max_size)
+{
+	if (max_size < 0) {
+		return NULL;
+	}
+	struct hpack_fixed_layout layout;
+	hpack_fixed_layout(max_size, &layout);
+	if (mem_size < layout.size) {
+		return NULL;
+	}
+
+	hpack_t *hpack = mem;
+	bzero(hpack, sizeof(hpack_t));
+	hpack->buf_max = max_size;
+	hpack->buf_limit = max_size;
+	hpack->allocator = hpack_fixed_allocator;
+	hpack->fixed = true;
+
+	/* the table is in full size, so never grows */
+	char *base = mem;
+	hpack->entries = (struct hpack_dynamic_entry *)(base + layout.entries);
+	hpack->entry_size = layout.entry_size;
+	hpack->data = base + layout.data;
+	hpack->data_size = max_size;
+
+	/* the encoder index if there is room, or look up by scanning */
+	if (mem_size >= layout.index_size) {
+		hpack->name_buckets = (uint32_t *)(base + layout.buckets);
+		hpack->buckets = hpack->name_buckets + layout.entry_size;
+		memset(hpack->name_buckets, 0xff, sizeof(uint32_t) * layout.entry_size * 2);
+		hpack->links = (struct hpack_dynamic_link *)(base + layout.links);
+	}
+	return hpack;
+}
+
+void hpack_decode_scratch(hpack_t *hpack, char *buf, int size)
+{
+	if (!hpack->fixed) {
+		return;
+	}
+	/* half for names and half for values */
+	hpack->decode_bufs[0] = buf;
+	hpack->decode_bufs[1] = buf + size / 2;
+	hpack->decode_buf_sizes[0] = size / 2;
+	hpack->decode_buf_sizes[1] = size / 2;
+}
+
+void hpack_free(hpack_t *hpack)
+{
+	hpack_mem_free(hpack, hpack->data);
+	hpack_mem_free(hpack, hpack->entries);
+	hpack_mem_free(hpack, hpack->name_buckets);
+	hpack_mem_free(hpack, hpack->buckets);
+	hpack_mem_free(hpack, hpack->links);
+	hpack_mem_free(hpack, hpack->decode_bufs[0]);
+	hpack_mem_free(hpack, hpack->decode_bufs[1]);
+	hpack_mem_free(hpack, hpack->spill);
+
+	struct hpack_allocator allocator = hpack->allocator;
+	allocator.free(allocator.data, hpack);
 }
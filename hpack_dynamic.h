@@ -4,12 +4,174 @@
 #include <stdbool.h>
 
 #include "hpack.h"
+#include "huffman.h"
+
+#define HPACK_DYNAMIC_EXTRA_SIZE	32	/* see RFC 7541 Section 4.1 */
+
+struct hpack_dynamic_entry {
+	int		offset;		/* of name in hpack->data */
+	int		name_len;
+	int		value_len;
+	int		token;		/* of name, for decoder */
+};
+
+/* of an entry for encoder index, chained by insertion counter */
+struct hpack_dynamic_link {
+	uint32_t	name_hash;
+	uint32_t	hash;		/* of name and value */
+	uint32_t	name_next;
+	uint32_t	next;
+};
+
+/* field in progress of hpack_decode_block_feed() */
+struct hpack_decode_state {
+	int		step;		/* 0 at the beginning of a field */
+	uint8_t		first;		/* the first byte of the field */
+
+	/* integer in progress */
+	bool		int_more;
+	int		int_shift;
+	uint64_t	int_value;
+
+	int		name_index;	/* literal name in decode_bufs[0] if 0 */
+	int		name_len;
+
+	/* string in progress, in decode_bufs[] */
+	bool		is_huffman;
+	struct huffman_decoder huffman;
+	int		str_in;		/* input length fed */
+	int		str_left;	/* input length left */
+	int		str_len;	/* output length */
+
+	int		list_size;	/* of the block */
+};
+
+#ifdef HPACK_STATS
+#define HPACK_STATS_ADD(hpack, field, n)	((hpack)->stats.field += (n))
+#else
+#define HPACK_STATS_ADD(hpack, field, n)
+#endif
+
+/* State of dry-run encoding of a header block. Inserts of the block are
+ * recorded as flags of the headers, and evictions as counters, so the
+ * dynamic table is not changed. */
+struct hpack_dynamic_dry {
+	const struct hpack_header *headers;
+	uint8_t		*inserted;	/* if each header is inserted */
+	int		current;	/* the header in encoding */
+	int		first;		/* no live inserted header before it */
+	int		live;		/* live inserted headers */
+	uint32_t	evict_count;	/* of the table */
+	int		buf_used;
+};
+
+struct hpack_s {
+	int		buf_max;
+	int		buf_used;
+
+	/* the protocol limit of buf_max for decoder, which is
+	 * SETTINGS_HEADER_TABLE_SIZE set by hpack_new() or hpack_max_size() */
+	int		buf_limit;
+
+	/* strings of entries, a ring buffer growing up to buf_max */
+	char		*data;
+	int		data_size;
+	int		data_tail;
+
+	/* entries ring, indexed by the absolute insertion counter */
+	struct hpack_dynamic_entry *entries;
+	int		entry_size;	/* power of 2 */
+	uint32_t	insert_count;
+	uint32_t	evict_count;
+
+	/* encoder index, created on first lookup, sized as entry_size,
+	 * and links of entries in the same ring as entries */
+	uint32_t	*name_buckets;
+	uint32_t	*buckets;
+	struct hpack_dynamic_link *links;
+
+	/* leave huffman values in input, see hpack_decode_lazy_huffman() */
+	bool		lazy_huffman;
+
+	/* decoding across input fragments */
+	struct hpack_decode_state decode_state;
+
+	/* size update for encoder to emit, see hpack_max_size() */
+	bool		size_update;
+	int		size_update_min;	/* the smallest since last emitted */
+
+	/* encoder indexing policy, see hpack_index_policy() */
+	hpack_index_policy_f policy;
+	void		*policy_data;
+
+	/* header split by hpack_encode_block_resume(), and the output position */
+	uint8_t		*spill;
+	int		spill_size;
+	int		spill_len;
+	int		spill_pos;
+
+#ifdef HPACK_STATS
+	struct hpack_stats stats;
+#endif
+
+	/* for all memory of the context, see hpack_new_ex() */
+	struct hpack_allocator allocator;
+
+	/* in caller's memory with buffers of full size, see hpack_init() */
+	bool		fixed;
+
+	/* set during dry-run encoding, see hpack_encode_block() */
+	struct hpack_dynamic_dry *dry;
+
+	/* decoded huffman strings, for name and value */
+	char		*decode_bufs[2];
+	int		decode_buf_sizes[2];
+};
+
+static inline void *hpack_mem_alloc(hpack_t *hpack, size_t size)
+{
+	return hpack->allocator.alloc(hpack->allocator.data, size);
+}
+
+static inline void *hpack_mem_realloc(hpack_t *hpack, void *ptr, size_t size)
+{
+	return hpack->allocator.realloc(hpack->allocator.data, ptr, size);
+}
+
+static inline void hpack_mem_free(hpack_t *hpack, void *ptr)
+{
+	hpack->allocator.free(hpack->allocator.data, ptr);
+}
+
+/* change max_size without emitting a size update, for decoder.
+ * Fail if above buf_limit. */
+int hpack_dynamic_max_size(hpack_t *hpack, int max_size);
 
 int hpack_dynamic_add(hpack_t *hpack, const char *name_str, int name_len,
-		const char *value_str, int value_len);
+		const char *value_str, int value_len, int token);
 
-bool hpack_dynamic_decode(hpack_t *hpack, int index,
-		const char **name_str, int *name_len,
+int hpack_dynamic_decode(hpack_t *hpack, int index,
+		const char **name_str, int *name_len, int *token,
 		const char **value_str, int *value_len);
 
+/* if the entry can be added without emptying the table */
+static inline bool hpack_dynamic_fit(hpack_t *hpack, int name_len, int value_len)
+{
+	return name_len + value_len + HPACK_DYNAMIC_EXTRA_SIZE <= hpack->buf_max;
+}
+
+/* Return the index of name-value entry, or 0 with @name_index set to
+ * the index of name-only entry if any. Only name is matched if
+ * @value_str is NULL. */
+int hpack_dynamic_encode(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index);
+
+/* the same as hpack_dynamic_encode() and hpack_dynamic_add(), but on
+ * the table as changed by hpack->dry */
+int hpack_dynamic_dry_encode(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index);
+void hpack_dynamic_dry_add(hpack_t *hpack, int name_len, int value_len);
+
+char *hpack_decode_buffer(hpack_t *hpack, int which, int size);
+
 #endif
@@ -1,5 +1,11 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "hpack.h"
 #include "huffman.h"
@@ -50,73 +56,512 @@ int hpack_encode_status(int status, uint8_t *out_buf, uint8_t *out_end)
 
 int hpack_encode_content_length(size_t content_length, uint8_t *out_buf, uint8_t *out_end)
 {
-	if (out_end < out_buf + 3) {
+	if (out_end < out_buf + 4) {
 		return HPERR_NO_SPACE;
 	}
 
-	out_buf[0] = 0x40 | 28; /* index of content-length */
+	/* without indexing, for there is no context to add the entry,
+	 * and name index 28 of content-length in 4-bit prefix */
+	out_buf[0] = 0x0f;
+	out_buf[1] = 28 - 0x0f;
 
-	int size = out_end - out_buf - 2;
-	int len = snprintf((char *)out_buf + 2, size, "%zu", content_length);
-	if (len == size) {
+	/* snprintf() needs one more byte for the terminating '\0' */
+	int size = out_end - out_buf - 3;
+	int len = snprintf((char *)out_buf + 3, size, "%zu", content_length);
+	if (len >= size) {
 		return HPERR_NO_SPACE;
 	}
-	out_buf[1] = len;
-	return 2 + len;
+	out_buf[2] = len;
+	return 3 + len;
 }
 
-static int hpack_encode_int(int n, uint8_t prefix_bits,
-		uint8_t *out_buf, uint8_t *out_end)
+static int hpack_encode_int_len(int n, int prefix_bits)
 {
-	uint8_t prefix_max = (1 << prefix_bits) - 1;
-
-	uint8_t *out_pos = out_buf;
-	if (out_pos >= out_end) {
-		return -1;
+	int prefix_max = (1 << prefix_bits) - 1;
+	if (n < prefix_max) { /* 1-charactor case */
+		return 1;
 	}
 
+	/* 7 bits per byte */
+	int bits = 32 - __builtin_clz((n - prefix_max) | 1);
+	return 1 + (bits + 6) / 7;
+}
+
+/* Spread 7-bit groups into @len bytes in little-endian, with the MSB
+ * set in all bytes but the last. */
+static inline uint64_t hpack_encode_int_scatter(uint32_t v, int len)
+{
+#ifdef __BMI2__
+	uint64_t x = _pdep_u64(v, 0x7f7f7f7f7full);
+#else
+	uint64_t x = (v & 0x7f) | ((uint64_t)(v & 0x3f80) << 1)
+			| ((uint64_t)(v & 0x1fc000) << 2) | ((uint64_t)(v & 0xfe00000) << 3)
+			| ((uint64_t)(v & 0xf0000000) << 4);
+#endif
+	return x | (0x8080808080ull & ((1ull << ((len - 1) * 8)) - 1));
+}
+
+/* write without checking space, with @first as the flag bits */
+static uint8_t *hpack_encode_int(uint8_t *out_pos, uint8_t first,
+		int n, int prefix_bits)
+{
+	int prefix_max = (1 << prefix_bits) - 1;
 	if (n < prefix_max) { /* 1-charactor case */
-		out_buf[0] |= n;
-		return 1;
+		*out_pos++ = first | n;
+		return out_pos;
+	}
+
+	*out_pos++ = first | prefix_max;
+
+	int len = hpack_encode_int_len(n, prefix_bits) - 1;
+	uint64_t x = hpack_encode_int_scatter(n - prefix_max, len);
+	int i;
+	for (i = 0; i < len; i++) {
+		out_pos[i] = x >> (i * 8);
 	}
+	return out_pos + len;
+}
+
+struct hpack_encode_string {
+	const char	*str;
+	int		str_len;
+	int		len;		/* after huffman encoding if any */
+	bool		is_huffman;
+	bool		is_encoded;	/* str is in huffman already */
+};
 
-	*out_pos++ |= prefix_max;
-	n -= prefix_max;
-	while (n > 0x7F) {
-		*out_pos++ = 0x80 | (n & 0x7F);
-		n >>= 7;
-		if (out_pos >= out_end) {
-			return -1;
+/* return the encoded length */
+static int hpack_encode_string_prepare(struct hpack_encode_string *es,
+		const char *str, int str_len)
+{
+	/* use huffman only if it saves bytes */
+	int huffman_len = huffman_encoded_len(str, str_len);
+	es->str = str;
+	es->str_len = str_len;
+	es->is_encoded = false;
+	es->is_huffman = huffman_len < str_len;
+	es->len = es->is_huffman ? huffman_len : str_len;
+	return hpack_encode_int_len(es->len, 7) + es->len;
+}
+
+/* the string in huffman already, from lazy decoding */
+static int hpack_encode_string_prepare_encoded(struct hpack_encode_string *es,
+		const char *str, int str_len)
+{
+	es->str = str;
+	es->str_len = str_len;
+	es->len = str_len;
+	es->is_huffman = true;
+	es->is_encoded = true;
+	return hpack_encode_int_len(es->len, 7) + es->len;
+}
+
+static uint8_t *hpack_encode_string(uint8_t *out_pos, const struct hpack_encode_string *es)
+{
+	out_pos = hpack_encode_int(out_pos, es->is_huffman ? 0x80 : 0, es->len, 7);
+	if (es->is_huffman && !es->is_encoded) {
+		huffman_encode(es->str, es->str_len, out_pos, es->len);
+	} else {
+		memcpy(out_pos, es->str, es->str_len);
+	}
+	return out_pos + es->len;
+}
+
+/* the representation of a header */
+struct hpack_encode_field {
+	int		index;		/* Indexed Header Field if >0 */
+	int		name_index;	/* literal name if 0 */
+	enum hpack_indexing indexing;
+	struct hpack_encode_string name;
+	struct hpack_encode_string value;
+};
+
+/* names never indexed or not indexed by default */
+static const struct {
+	const char		*name;
+	int			len;
+	enum hpack_indexing	indexing;
+} hpack_index_policy_names[] = {
+	{ "authorization", 13, HPACK_INDEXING_NEVER },
+	{ "proxy-authorization", 19, HPACK_INDEXING_NEVER },
+	{ "cookie", 6, HPACK_INDEXING_NEVER },
+	{ "set-cookie", 10, HPACK_INDEXING_NEVER },
+	{ "content-length", 14, HPACK_INDEXING_NONE },
+	{ "date", 4, HPACK_INDEXING_NONE },
+	{ "etag", 4, HPACK_INDEXING_NONE },
+	{ "last-modified", 13, HPACK_INDEXING_NONE },
+	{ "if-none-match", 13, HPACK_INDEXING_NONE },
+	{ "if-modified-since", 17, HPACK_INDEXING_NONE },
+	{ "age", 3, HPACK_INDEXING_NONE },
+	{ "x-request-id", 12, HPACK_INDEXING_NONE },
+};
+
+enum hpack_indexing hpack_index_policy_default(void *data,
+		const char *name_str, int name_len,
+		const char *value_str, int value_len)
+{
+	int i;
+	for (i = 0; i < sizeof(hpack_index_policy_names) / sizeof(hpack_index_policy_names[0]); i++) {
+		if (name_len == hpack_index_policy_names[i].len
+				&& memcmp(name_str, hpack_index_policy_names[i].name, name_len) == 0) {
+			return hpack_index_policy_names[i].indexing;
 		}
 	}
-	*out_pos++ = n;
+	if (value_len > HPACK_INDEX_VALUE_MAX) {
+		return HPACK_INDEXING_NONE;
+	}
+	return HPACK_INDEXING;
+}
 
-	return out_pos - out_buf;
+void hpack_index_policy(hpack_t *hpack, hpack_index_policy_f policy, void *data)
+{
+	hpack->policy = policy;
+	hpack->policy_data = data;
 }
 
-static int hpack_encode_string(const char *s, int str_len,
-		uint8_t *out_buf, uint8_t *out_end)
+static enum hpack_indexing hpack_encode_indexing(hpack_t *hpack,
+		const char *name_str, int name_len,
+		const char *value_str, int value_len)
 {
-	out_buf[0] = 0;
-	int encode_len = hpack_encode_int(str_len, 7, out_buf, out_end);
-	if (encode_len < 0) {
-		return -1;
+	if (hpack == NULL) {
+		/* no dynamic table, while sensitive headers are still marked */
+		enum hpack_indexing indexing = hpack_index_policy_default(NULL,
+				name_str, name_len, value_str, value_len);
+		return indexing == HPACK_INDEXING_NEVER ? indexing : HPACK_INDEXING_NONE;
 	}
 
-	uint8_t *out_pos = out_buf + encode_len;
-	if (out_end - out_pos < str_len) {
-		return -1;
+	enum hpack_indexing indexing = (hpack->policy != NULL)
+			? hpack->policy(hpack->policy_data, name_str, name_len, value_str, value_len)
+			: hpack_index_policy_default(NULL, name_str, name_len, value_str, value_len);
+	if (indexing == HPACK_INDEXING && !hpack_dynamic_fit(hpack, name_len, value_len)) {
+		return HPACK_INDEXING_NONE;
 	}
-	memcpy(out_pos, s, str_len);
-	out_pos += str_len;
+	return indexing;
+}
 
-	return out_pos - out_buf;
+/* look up the dynamic table, as changed by the block so far if dry run */
+static int hpack_encode_dynamic(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index)
+{
+	if (hpack->dry != NULL) {
+		return hpack_dynamic_dry_encode(hpack, name_str, name_len,
+				value_str, value_len, name_index);
+	}
+	return hpack_dynamic_encode(hpack, name_str, name_len,
+			value_str, value_len, name_index);
+}
+
+/* return the length of Literal Header Field */
+static int hpack_encode_prepare_literal(struct hpack_encode_field *f,
+		const struct hpack_header *h)
+{
+	int len;
+	if (f->name_index == 0) {
+		len = 1 + hpack_encode_string_prepare(&f->name, h->name_str, h->name_len);
+	} else {
+		len = hpack_encode_int_len(f->name_index,
+				f->indexing == HPACK_INDEXING ? 6 : 4);
+	}
+	if (h->value_huffman) {
+		return len + hpack_encode_string_prepare_encoded(&f->value,
+				h->value_str, h->value_len);
+	}
+	return len + hpack_encode_string_prepare(&f->value, h->value_str, h->value_len);
+}
+
+/* Decide the representation by looking up the tables, and return
+ * the encoded length. The name is in lower case. */
+static int hpack_encode_prepare(hpack_t *hpack, struct hpack_encode_field *f,
+		const struct hpack_header *h)
+{
+	const char *name_str = h->name_str;
+	int name_len = h->name_len;
+	const char *value_str = h->value_str;
+	int value_len = h->value_len;
+
+	/* The value is still in huffman from lazy decoding, and it was not
+	 * indexed, so keep it so and look up the name only. The policy can
+	 * still make it never indexed by the name. */
+	if (h->value_huffman) {
+		f->index = 0;
+		f->indexing = h->never_indexed || hpack_encode_indexing(hpack,
+				name_str, name_len, NULL, 0) == HPACK_INDEXING_NEVER
+				? HPACK_INDEXING_NEVER : HPACK_INDEXING_NONE;
+		f->name_index = hpack_static_encode_name(name_str, name_len);
+		if (f->name_index < 0) {
+			f->name_index = 0;
+			if (hpack != NULL) {
+				hpack_encode_dynamic(hpack, name_str, name_len,
+						NULL, 0, &f->name_index);
+			}
+		}
+		return hpack_encode_prepare_literal(f, h);
+	}
+
+	/* -- Indexed Header Field, if found in static table */
+	f->index = hpack_static_encode(name_str, name_len,
+			value_str, value_len, &f->name_index);
+	if (f->index > 0) {
+		f->indexing = HPACK_INDEXING_NONE;
+		return hpack_encode_int_len(f->index, 7);
+	}
+
+	f->indexing = h->never_indexed ? HPACK_INDEXING_NEVER
+			: hpack_encode_indexing(hpack, name_str, name_len, value_str, value_len);
+
+	/* -- Indexed Header Field, if found in dynamic table.
+	 * Sensitive values are not looked up, to not leak by compression. */
+	if (hpack != NULL) {
+		int dynamic_name_index;
+		if (f->indexing != HPACK_INDEXING_NEVER) {
+			f->index = hpack_encode_dynamic(hpack, name_str, name_len,
+					value_str, value_len, &dynamic_name_index);
+		} else if (f->name_index == 0) {
+			f->index = hpack_encode_dynamic(hpack, name_str, name_len,
+					NULL, 0, &dynamic_name_index);
+		}
+		if (f->name_index == 0) {
+			f->name_index = dynamic_name_index;
+		}
+		if (f->index > 0) {
+			f->indexing = HPACK_INDEXING_NONE;
+			return hpack_encode_int_len(f->index, 7);
+		}
+	}
+
+	/* -- Literal Header Field */
+	return hpack_encode_prepare_literal(f, h);
+}
+
+/* write without checking space */
+static uint8_t *hpack_encode_write(uint8_t *out_pos, const struct hpack_encode_field *f)
+{
+	if (f->index > 0) {
+		return hpack_encode_int(out_pos, 0x80, f->index, 7);
+	}
+
+	uint8_t first;
+	switch (f->indexing) {
+	case HPACK_INDEXING:
+		first = 0x40;
+		break;
+	case HPACK_INDEXING_NEVER:
+		first = 0x10;
+		break;
+	default:
+		first = 0;
+	}
+	if (f->name_index == 0) {
+		*out_pos++ = first;
+		out_pos = hpack_encode_string(out_pos, &f->name);
+	} else {
+		out_pos = hpack_encode_int(out_pos, first, f->name_index,
+				f->indexing == HPACK_INDEXING ? 6 : 4);
+	}
+	return hpack_encode_string(out_pos, &f->value);
+}
+
+/* the smallest size first if it is not the final one */
+static int hpack_encode_size_update_len(hpack_t *hpack)
+{
+	if (hpack == NULL || !hpack->size_update) {
+		return 0;
+	}
+	int len = hpack_encode_int_len(hpack->buf_max, 5);
+	if (hpack->size_update_min < hpack->buf_max) {
+		len += hpack_encode_int_len(hpack->size_update_min, 5);
+	}
+	return len;
+}
+
+static uint8_t *hpack_encode_size_update_write(hpack_t *hpack, uint8_t *out_pos)
+{
+	if (hpack->size_update_min < hpack->buf_max) {
+		out_pos = hpack_encode_int(out_pos, 0x20, hpack->size_update_min, 5);
+	}
+	return hpack_encode_int(out_pos, 0x20, hpack->buf_max, 5);
+}
+
+int hpack_encode_size_update(hpack_t *hpack, uint8_t *out_buf, uint8_t *out_end)
+{
+	int len = hpack_encode_size_update_len(hpack);
+	if (len == 0) {
+		return 0;
+	}
+	if (out_buf == NULL) {
+		return len;
+	}
+	if (out_end - out_buf < len) {
+		return HPERR_NO_SPACE;
+	}
+	hpack_encode_size_update_write(hpack, out_buf);
+	hpack->size_update = false;
+	return len;
+}
+
+static uint8_t *hpack_encode_spill_buffer(hpack_t *hpack, int size)
+{
+	if (size > hpack->spill_size) {
+		uint8_t *buf = hpack_mem_realloc(hpack, hpack->spill, size);
+		if (buf == NULL) {
+			return NULL;
+		}
+		hpack->spill = buf;
+		hpack->spill_size = size;
+	}
+	return hpack->spill;
+}
+
+/* Encode a header with name in lower case. If @out_buf is NULL, just
+ * return the length, while the dynamic table is updated too.
+ * If @spill is set and the output buffer is not enough, fill it and
+ * keep the rest in hpack->spill. */
+static void hpack_encode_count(hpack_t *hpack, const struct hpack_encode_field *f,
+		const struct hpack_header *h, int len)
+{
+	if (hpack == NULL) {
+		return;
+	}
+
+	if (f->index > HPACK_STATIC_TABLE_SIZE) {
+		HPACK_STATS_ADD(hpack, indexed_dynamic, 1);
+	} else if (f->index > 0) {
+		HPACK_STATS_ADD(hpack, indexed_static, 1);
+	} else {
+		if (f->indexing == HPACK_INDEXING) {
+			HPACK_STATS_ADD(hpack, literal_indexing, 1);
+		} else if (f->indexing == HPACK_INDEXING_NEVER) {
+			HPACK_STATS_ADD(hpack, literal_never, 1);
+		} else {
+			HPACK_STATS_ADD(hpack, literal_none, 1);
+		}
+		if (f->name_index == 0 && f->name.is_huffman) {
+			HPACK_STATS_ADD(hpack, huffman_saved_bytes, f->name.str_len - f->name.len);
+		}
+		if (f->value.is_huffman && !f->value.is_encoded) {
+			HPACK_STATS_ADD(hpack, huffman_saved_bytes, f->value.str_len - f->value.len);
+		}
+	}
+	HPACK_STATS_ADD(hpack, raw_bytes, h->name_len + h->value_len);
+	HPACK_STATS_ADD(hpack, coded_bytes, len);
+}
+
+static int hpack_encode_lower(hpack_t *hpack, const struct hpack_header *h,
+		uint8_t *out_buf, uint8_t *out_end, bool spill)
+{
+	struct hpack_encode_field f;
+	int len = hpack_encode_prepare(hpack, &f, h);
+
+	/* Pending size update goes before the first header resumed, in the
+	 * same output, since the buffer may be too small for it alone. Other
+	 * callers emit it by hpack_encode_size_update() at the beginning. */
+	int update_len = spill ? hpack_encode_size_update_len(hpack) : 0;
+	len += update_len;
+	int out_len = len;
+
+	if (out_buf != NULL) {
+		if (out_end - out_buf >= len) {
+			if (update_len > 0) {
+				hpack_encode_size_update_write(hpack, out_buf);
+			}
+			hpack_encode_write(out_buf + update_len, &f);
+		} else if (spill) {
+			uint8_t *spill_buf = hpack_encode_spill_buffer(hpack, len);
+			if (spill_buf == NULL) {
+				return HPERR_NOMEM;
+			}
+			if (update_len > 0) {
+				hpack_encode_size_update_write(hpack, spill_buf);
+			}
+			hpack_encode_write(spill_buf + update_len, &f);
+			hpack->spill_len = len;
+			hpack->spill_pos = out_len = out_end - out_buf;
+			memcpy(out_buf, spill_buf, out_len);
+		} else {
+			return HPERR_NO_SPACE;
+		}
+	}
+
+	/* add to dynamic table, only after the output succeeds */
+	if (update_len > 0) {
+		hpack->size_update = false;
+	}
+	if (f.indexing == HPACK_INDEXING) {
+		if (hpack->dry != NULL) {
+			hpack_dynamic_dry_add(hpack, h->name_len, h->value_len);
+			return out_len;
+		}
+		int ret = hpack_dynamic_add(hpack, h->name_str, h->name_len,
+				h->value_str, h->value_len,
+				hpack_name_token(h->name_str, h->name_len));
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	if (hpack == NULL || hpack->dry == NULL) {
+		hpack_encode_count(hpack, &f, h, len);
+	}
+	return out_len;
+}
+
+/* names are lowercased into stack if not longer than this, or heap */
+#define HPACK_LOWER_STACK_SIZE	256
+
+#ifdef __SSE2__
+/* 0xff for 'A'-'Z', or 0 */
+static inline __m128i hpack_upper_mask16(__m128i c)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+			_mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), c));
+}
+#endif
+#ifdef __AVX2__
+static inline __m256i hpack_upper_mask32(__m256i c)
+{
+	return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+			_mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+}
+#endif
+
+static bool hpack_has_upper(const char *str, int len)
+{
+	int i = 0;
+#ifdef __AVX2__
+	for (; i + 32 <= len; i += 32) {
+		__m256i c = _mm256_loadu_si256((const __m256i *)(str + i));
+		if (!_mm256_testz_si256(hpack_upper_mask32(c), hpack_upper_mask32(c))) {
+			return true;
+		}
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(str + i));
+		if (_mm_movemask_epi8(hpack_upper_mask16(c)) != 0) {
+			return true;
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if (str[i] >= 'A' && str[i] <= 'Z') {
+			return true;
+		}
+	}
+	return false;
 }
 
 static void hpack_downcase(char *dest, const char *src, int len)
 {
-	int i;
-	for (i = 0; i < len; i++) {
+	int i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lower = _mm_and_si128(hpack_upper_mask16(c), _mm_set1_epi8(0x20));
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_or_si128(c, lower));
+	}
+#endif
+	for (; i < len; i++) {
 		if (src[i] >= 'A' && src[i] <= 'Z') {
 			dest[i] = src[i] | 0x20;
 		} else {
@@ -125,37 +570,206 @@ static void hpack_downcase(char *dest, const char *src, int len)
 	}
 }
 
-int hpack_encode_header(hpack_t *hpack, const char *name_raw, int name_len,
-		const char *value_raw, int value_len,
+static int hpack_encode_field(hpack_t *hpack, const struct hpack_header *h,
+		uint8_t *out_buf, uint8_t *out_end, bool spill)
+{
+	/* only name is case-insensitive, and used directly if in lower case */
+	if (!hpack_has_upper(h->name_str, h->name_len)) {
+		return hpack_encode_lower(hpack, h, out_buf, out_end, spill);
+	}
+
+	char stack_buf[HPACK_LOWER_STACK_SIZE];
+	char *lower = stack_buf;
+	if (h->name_len > sizeof(stack_buf)) {
+		lower = hpack ? hpack_mem_alloc(hpack, h->name_len) : malloc(h->name_len);
+		if (lower == NULL) {
+			return HPERR_NOMEM;
+		}
+	}
+	hpack_downcase(lower, h->name_str, h->name_len);
+
+	struct hpack_header lower_header = *h;
+	lower_header.name_str = lower;
+	int ret = hpack_encode_lower(hpack, &lower_header, out_buf, out_end, spill);
+
+	if (lower != stack_buf) {
+		if (hpack) {
+			hpack_mem_free(hpack, lower);
+		} else {
+			free(lower);
+		}
+	}
+	return ret;
+}
+
+int hpack_encode_header(hpack_t *hpack, const char *name_str, int name_len,
+		const char *value_str, int value_len,
 		uint8_t *out_buf, uint8_t *out_end)
 {
-	char name_str[name_len];
-	char value_str[value_len];
-	hpack_downcase(name_str, name_raw, name_len);
-	hpack_downcase(value_str, value_raw, value_len);
+	struct hpack_header h = {
+		.name_str = name_str,
+		.name_len = name_len,
+		.value_str = value_str,
+		.value_len = value_len,
+	};
+	return hpack_encode_field(hpack, &h, out_buf, out_end, false);
+}
+
+/* flags of inserted headers are in stack for blocks up to this, or heap */
+#define HPACK_DRY_STACK_SIZE	1024
+
+static int hpack_encode_block_dry(hpack_t *hpack, const struct hpack_header *headers,
+		int count)
+{
+	uint8_t stack_buf[HPACK_DRY_STACK_SIZE];
+	struct hpack_dynamic_dry dry = {
+		.headers = headers,
+		.evict_count = hpack->evict_count,
+		.buf_used = hpack->buf_used,
+	};
+	dry.inserted = (count <= HPACK_DRY_STACK_SIZE) ? stack_buf : hpack_mem_alloc(hpack, count);
+	if (dry.inserted == NULL) {
+		return HPERR_NOMEM;
+	}
+	memset(dry.inserted, 0, count);
+
+	int total = hpack_encode_size_update(hpack, NULL, NULL);
+	hpack->dry = &dry;
+	for (dry.current = 0; dry.current < count; dry.current++) {
+		int len = hpack_encode_field(hpack, &headers[dry.current], NULL, NULL, false);
+		if (len < 0) {
+			total = len;
+			break;
+		}
+		total += len;
+	}
+	hpack->dry = NULL;
+
+	if (dry.inserted != stack_buf) {
+		hpack_mem_free(hpack, dry.inserted);
+	}
+	return total;
+}
+
+int hpack_encode_block(hpack_t *hpack, const struct hpack_header *headers,
+		int count, uint8_t *out_buf, uint8_t *out_end)
+{
+	/* dry run keeps the dynamic table unchanged */
+	if (out_buf == NULL && hpack != NULL) {
+		return hpack_encode_block_dry(hpack, headers, count);
+	}
+
+	/* pending size update goes first, even if no header */
+	int total = hpack_encode_size_update(hpack, out_buf, out_end);
+	if (total < 0) {
+		return total;
+	}
+	uint8_t *out_pos = out_buf ? out_buf + total : NULL;
+
+	int i;
+	for (i = 0; i < count; i++) {
+		const struct hpack_header *h = &headers[i];
+		int len = hpack_encode_field(hpack, h, out_pos, out_end, false);
+		if (len < 0) {
+			return len;
+		}
+		if (out_pos != NULL) {
+			out_pos += len;
+		}
+		total += len;
+	}
+	return total;
+}
 
+int hpack_encode_block_resume(hpack_t *hpack, const struct hpack_header *headers,
+		int count, int *next, uint8_t *out_buf, uint8_t *out_end)
+{
 	uint8_t *out_pos = out_buf;
-	out_pos[0] = 0;
 
-	int len;
+	/* the rest of header spilled in last call */
+	if (hpack->spill_pos < hpack->spill_len) {
+		int len = hpack->spill_len - hpack->spill_pos;
+		if (len > out_end - out_pos) {
+			len = out_end - out_pos;
+		}
+		memcpy(out_pos, hpack->spill + hpack->spill_pos, len);
+		out_pos += len;
+		hpack->spill_pos += len;
+		if (hpack->spill_pos < hpack->spill_len) {
+			return out_pos - out_buf;
+		}
+		(*next)++;
+	}
 
-	/* name */
-	int index = hpack_static_encode_name(name_str, name_len);
-	if (index < 0) {
-		out_pos++;
-		len = hpack_encode_string(name_str, name_len, out_pos, out_end);
-	} else {
-		len = hpack_encode_int(index, 4, out_pos, out_end);
+	while (*next < count) {
+		const struct hpack_header *h = &headers[*next];
+		int len = hpack_encode_field(hpack, h, out_pos, out_end, true);
+		if (len < 0) {
+			return len;
+		}
+		out_pos += len;
+		if (hpack->spill_pos < hpack->spill_len) {
+			break;
+		}
+		(*next)++;
 	}
+	return out_pos - out_buf;
+}
+
+struct hpack_transcode {
+	hpack_t		*encoder;
+	uint8_t		*out_pos;
+	uint8_t		*out_end;
+
+	int		error;	/* the first error of encoding */
+};
+
+static int hpack_transcode_handler(void *data, const struct hpack_header *header)
+{
+	struct hpack_transcode *tc = data;
+
+	/* go on decoding without encoding, to keep the decoder in sync */
+	if (tc->error != 0) {
+		return 0;
+	}
+	int len = hpack_encode_field(tc->encoder, header, tc->out_pos, tc->out_end, false);
 	if (len < 0) {
-		return len;
+		tc->error = len;
+		return 0;
+	}
+	tc->out_pos += len;
+	return 0;
+}
+
+int hpack_transcode_block(hpack_t *decoder,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		hpack_t *encoder, uint8_t *out_buf, uint8_t *out_end)
+{
+	struct hpack_transcode tc = {
+		.encoder = encoder,
+		.out_pos = out_buf,
+		.out_end = out_end,
+	};
+
+	/* pending size update goes first */
+	int ret = hpack_encode_size_update(encoder, out_buf, out_end);
+	if (ret < 0) {
+		return ret;
 	}
-	out_pos += len;
+	tc.out_pos += ret;
 
-	/* value */
-	// TODO use hpack !!!
-	len = hpack_encode_string(value_str, value_len, out_pos, out_end);
-	out_pos += len;
+	/* values not indexed are passed through in huffman */
+	bool lazy_huffman = decoder->lazy_huffman;
+	decoder->lazy_huffman = true;
+	ret = hpack_decode_block(decoder, in_buf, in_end, max_list_size,
+			hpack_transcode_handler, &tc);
+	decoder->lazy_huffman = lazy_huffman;
 
-	return out_pos - out_buf;
+	if (ret < 0) {
+		return ret;
+	}
+	if (tc.error < 0) {
+		return tc.error;
+	}
+	return tc.out_pos - out_buf;
 }
@@ -0,0 +1,499 @@
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+#include "hpack_dynamic.h"
+
+/* state of hpack_decode_http1() */
+struct hpack_http1 {
+	char		*out_pos;
+	char		*out_end;
+
+	/* Values staged at the end of output, growing down. Each is followed
+	 * by its length, so they can be read back in order from out_end. */
+	char		*tail;
+
+	/* pseudo-headers, staged before the request line */
+	bool		line_done;
+	const char	*method_str;
+	int		method_len;
+	const char	*path_str;
+	int		path_len;
+	const char	*authority_str;
+	int		authority_len;
+
+	/* cookies, staged to be joined into one line, see RFC 7540 8.1.2.5 */
+	int		cookie_count;
+
+	int		error;	/* the first error of the handler */
+};
+
+/* CR, LF and NUL would break the HTTP/1.1 message */
+static bool hpack_http1_valid(const char *str, int len, bool is_name)
+{
+	int i;
+	for (i = 0; i < len; i++) {
+		char c = str[i];
+		if (c == '\r' || c == '\n' || c == '\0' || (is_name && (c == ':' || c == ' '))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* SP and HTAB would split the request line */
+static bool hpack_http1_valid_token(const char *str, int len)
+{
+	int i;
+	for (i = 0; i < len; i++) {
+		if (str[i] == ' ' || str[i] == '\t') {
+			return false;
+		}
+	}
+	return len > 0;
+}
+
+static char *hpack_http1_write(char *pos, const char *str, int len)
+{
+	memcpy(pos, str, len);
+	return pos + len;
+}
+
+/* copy the value to the tail, and decode it if in huffman */
+static int hpack_http1_stage(struct hpack_http1 *hh, const struct hpack_header *h,
+		const char **str_p, int *len_p)
+{
+	int max_len = h->value_huffman
+			? HPACK_HUFFMAN_DECODED_MAX_LEN(h->value_len) : h->value_len;
+	if (hh->tail - hh->out_pos < max_len + (int)sizeof(int)) {
+		return HPERR_NO_SPACE;
+	}
+
+	char *start = hh->tail - sizeof(int) - max_len;
+	int len = hpack_header_value(h, start, start + max_len);
+	if (len < 0) {
+		return len;
+	}
+	if (!hpack_http1_valid(start, len, false)) {
+		return HPERR_MALFORMED_HEADER;
+	}
+
+	/* next to the length */
+	char *str = start + max_len - len;
+	memmove(str, start, len);
+	memcpy(str + len, &len, sizeof(int));
+	hh->tail = str;
+
+	*str_p = str;
+	*len_p = len;
+	return 0;
+}
+
+/* the request line and Host header, from the staged pseudo-headers */
+static int hpack_http1_request_line(struct hpack_http1 *hh)
+{
+	if (hh->method_str == NULL) {
+		return HPERR_MALFORMED_HEADER;
+	}
+
+	const char *target_str = hh->path_str;
+	int target_len = hh->path_len;
+	if (target_str == NULL) { /* authority-form, see RFC 7540 8.3 */
+		if (hh->method_len != 7 || memcmp(hh->method_str, "CONNECT", 7) != 0
+				|| hh->authority_str == NULL) {
+			return HPERR_MALFORMED_HEADER;
+		}
+		target_str = hh->authority_str;
+		target_len = hh->authority_len;
+	}
+	if (!hpack_http1_valid_token(hh->method_str, hh->method_len)
+			|| !hpack_http1_valid_token(target_str, target_len)) {
+		return HPERR_MALFORMED_HEADER;
+	}
+
+	int len = hh->method_len + 1 + target_len + sizeof(" HTTP/1.1\r\n") - 1;
+	if (hh->authority_str != NULL) {
+		len += sizeof("Host: \r\n") - 1 + hh->authority_len;
+	}
+	if (hh->tail - hh->out_pos < len) {
+		return HPERR_NO_SPACE;
+	}
+
+	/* the staged values are above, so not covered */
+	char *pos = hh->out_pos;
+	pos = hpack_http1_write(pos, hh->method_str, hh->method_len);
+	*pos++ = ' ';
+	pos = hpack_http1_write(pos, target_str, target_len);
+	pos = hpack_http1_write(pos, " HTTP/1.1\r\n", 11);
+	if (hh->authority_str != NULL) {
+		pos = hpack_http1_write(pos, "Host: ", 6);
+		pos = hpack_http1_write(pos, hh->authority_str, hh->authority_len);
+		pos = hpack_http1_write(pos, "\r\n", 2);
+	}
+	hh->out_pos = pos;
+
+	hh->tail = hh->out_end;
+	hh->line_done = true;
+	return 0;
+}
+
+static int hpack_http1_cookie_line(struct hpack_http1 *hh)
+{
+	/* each staged value is followed by its length, while "; " is
+	 * between the values in the line */
+	int staged = hh->out_end - hh->tail;
+	int len = sizeof("cookie: \r\n") - 1 + staged
+			- ((int)sizeof(int) - 2) * hh->cookie_count - 2;
+	if (hh->tail - hh->out_pos < len) {
+		return HPERR_NO_SPACE;
+	}
+
+	char *pos = hpack_http1_write(hh->out_pos, "cookie: ", 8);
+	char *item = hh->out_end;
+	int i;
+	for (i = 0; i < hh->cookie_count; i++) {
+		int value_len;
+		memcpy(&value_len, item - sizeof(int), sizeof(int));
+		item -= sizeof(int) + value_len;
+		if (i != 0) {
+			pos = hpack_http1_write(pos, "; ", 2);
+		}
+		pos = hpack_http1_write(pos, item, value_len);
+	}
+	hh->out_pos = hpack_http1_write(pos, "\r\n", 2);
+	return 0;
+}
+
+static int hpack_http1_header(struct hpack_http1 *hh, const struct hpack_header *h)
+{
+
+	/* pseudo-headers, which must be before regular headers */
+	if (h->name_len > 0 && h->name_str[0] == ':') {
+		if (hh->line_done) {
+			return HPERR_MALFORMED_HEADER;
+		}
+
+		const char **str_p;
+		int *len_p;
+		switch (h->token) {
+		case HPACK_TOKEN_METHOD:
+			str_p = &hh->method_str;
+			len_p = &hh->method_len;
+			break;
+		case HPACK_TOKEN_PATH:
+			str_p = &hh->path_str;
+			len_p = &hh->path_len;
+			break;
+		case HPACK_TOKEN_AUTHORITY:
+			str_p = &hh->authority_str;
+			len_p = &hh->authority_len;
+			break;
+		case HPACK_TOKEN_SCHEME: /* not in HTTP/1.1 request */
+			return 0;
+		default:
+			return HPERR_MALFORMED_HEADER;
+		}
+		if (*str_p != NULL) {
+			return HPERR_MALFORMED_HEADER;
+		}
+		return hpack_http1_stage(hh, h, str_p, len_p);
+	}
+
+	if (!hh->line_done) {
+		int ret = hpack_http1_request_line(hh);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	if (!hpack_http1_valid(h->name_str, h->name_len, true)) {
+		return HPERR_MALFORMED_HEADER;
+	}
+
+	switch (h->token) {
+	case HPACK_TOKEN_COOKIE:
+		{
+		const char *str;
+		int len;
+		hh->cookie_count++;
+		return hpack_http1_stage(hh, h, &str, &len);
+		}
+	case HPACK_TOKEN_HOST:
+		if (hh->authority_str != NULL) { /* :authority wins */
+			return 0;
+		}
+		break;
+	}
+
+	/* "name: value\r\n", and the value is decoded in place */
+	if (hh->tail - hh->out_pos < h->name_len + 4) {
+		return HPERR_NO_SPACE;
+	}
+	char *pos = hpack_http1_write(hh->out_pos, h->name_str, h->name_len);
+	pos = hpack_http1_write(pos, ": ", 2);
+	int len = hpack_header_value(h, pos, hh->tail - 2);
+	if (len < 0) {
+		return len;
+	}
+	if (!hpack_http1_valid(pos, len, false)) {
+		return HPERR_MALFORMED_HEADER;
+	}
+	hh->out_pos = hpack_http1_write(pos + len, "\r\n", 2);
+	return 0;
+}
+
+static int hpack_http1_handler(void *data, const struct hpack_header *h)
+{
+	struct hpack_http1 *hh = data;
+
+	/* go on decoding without output, to keep the dynamic table in sync */
+	if (hh->error == 0) {
+		hh->error = hpack_http1_header(hh, h);
+	}
+	return 0;
+}
+
+int hpack_decode_http1(hpack_t *hpack,
+		const uint8_t *in_buf, const uint8_t *in_end, int max_list_size,
+		char *out_buf, char *out_end)
+{
+	struct hpack_http1 hh = {
+		.out_pos = out_buf,
+		.out_end = out_end,
+		.tail = out_end,
+	};
+
+	/* decode huffman values into the output directly */
+	bool lazy_huffman = hpack->lazy_huffman;
+	hpack->lazy_huffman = true;
+	int ret = hpack_decode_block(hpack, in_buf, in_end, max_list_size,
+			hpack_http1_handler, &hh);
+	hpack->lazy_huffman = lazy_huffman;
+	if (ret < 0) {
+		return ret;
+	}
+	if (hh.error < 0) {
+		return hh.error;
+	}
+
+	if (!hh.line_done) {
+		ret = hpack_http1_request_line(&hh);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	if (hh.cookie_count > 0) {
+		ret = hpack_http1_cookie_line(&hh);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return hh.out_pos - out_buf;
+}
+
+/* connection-specific headers, see RFC 7540 Section 8.1.2.2 */
+static const struct {
+	const char	*name;
+	int		len;
+} hpack_http1_hop_names[] = {
+	{ "connection", 10 },
+	{ "keep-alive", 10 },
+	{ "proxy-connection", 16 },
+	{ "transfer-encoding", 17 },
+	{ "upgrade", 7 },
+	{ "te", 2 },
+};
+
+/* values of Connection headers, whose options are removed too */
+#define HPACK_HTTP1_CONNECTION_MAX	8
+
+struct hpack_http1_connection {
+	int		count;
+	const char	*values[HPACK_HTTP1_CONNECTION_MAX];
+	int		value_lens[HPACK_HTTP1_CONNECTION_MAX];
+};
+
+static bool hpack_http1_name_is(const char *name_str, int name_len,
+		const char *str, int len)
+{
+	return name_len == len && strncasecmp(name_str, str, len) == 0;
+}
+
+static bool hpack_http1_is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* Parse a header line. Return 1 for a header, 0 at the end of header
+ * section, or negetive error code if fail. */
+static int hpack_http1_parse_line(const char **in_pos_p, const char *in_end,
+		struct hpack_header *h)
+{
+	const char *pos = *in_pos_p;
+	if (pos == in_end) {
+		return 0;
+	}
+	const char *eol = memchr(pos, '\n', in_end - pos);
+	const char *line_end = (eol != NULL) ? eol : in_end;
+	*in_pos_p = (eol != NULL) ? eol + 1 : in_end;
+	if (line_end > pos && line_end[-1] == '\r') {
+		line_end--;
+	}
+	if (line_end == pos) { /* the empty line */
+		return 0;
+	}
+	if (hpack_http1_is_space(*pos)) { /* obsolete line folding */
+		return HPERR_MALFORMED_HEADER;
+	}
+
+	/* name, without whitespace before the colon */
+	const char *colon = memchr(pos, ':', line_end - pos);
+	if (colon == NULL || colon == pos) {
+		return HPERR_MALFORMED_HEADER;
+	}
+	const char *p;
+	for (p = pos; p < colon; p++) {
+		if (hpack_http1_is_space(*p)) {
+			return HPERR_MALFORMED_HEADER;
+		}
+	}
+
+	/* value, with surrounding whitespace trimmed */
+	const char *value = colon + 1;
+	while (value < line_end && hpack_http1_is_space(*value)) {
+		value++;
+	}
+	while (line_end > value && hpack_http1_is_space(line_end[-1])) {
+		line_end--;
+	}
+
+	h->name_str = pos;
+	h->name_len = colon - pos;
+	h->value_str = value;
+	h->value_len = line_end - value;
+	return 1;
+}
+
+/* if the name is connection-specific, or listed in Connection headers */
+static bool hpack_http1_is_hop(const struct hpack_http1_connection *conn,
+		const char *name_str, int name_len)
+{
+	int i;
+	for (i = 0; i < sizeof(hpack_http1_hop_names) / sizeof(hpack_http1_hop_names[0]); i++) {
+		if (hpack_http1_name_is(name_str, name_len, hpack_http1_hop_names[i].name,
+					hpack_http1_hop_names[i].len)) {
+			return true;
+		}
+	}
+
+	/* comma-separated options */
+	for (i = 0; i < conn->count; i++) {
+		const char *pos = conn->values[i];
+		const char *end = pos + conn->value_lens[i];
+		while (pos < end) {
+			const char *comma = memchr(pos, ',', end - pos);
+			const char *opt_end = (comma != NULL) ? comma : end;
+			while (pos < opt_end && hpack_http1_is_space(*pos)) {
+				pos++;
+			}
+			const char *p = opt_end;
+			while (p > pos && hpack_http1_is_space(p[-1])) {
+				p--;
+			}
+			if (hpack_http1_name_is(name_str, name_len, pos, p - pos)) {
+				return true;
+			}
+			pos = opt_end + 1;
+		}
+	}
+	return false;
+}
+
+/* "HTTP/1.x SSS reason", return the status */
+static int hpack_http1_parse_status(const char **in_pos_p, const char *in_end)
+{
+	const char *pos = *in_pos_p;
+	if (in_end - pos < 12 || memcmp(pos, "HTTP/1.", 7) != 0
+			|| pos[7] < '0' || pos[7] > '9' || pos[8] != ' ') {
+		return HPERR_MALFORMED_HEADER;
+	}
+	pos += 9;
+
+	int status = 0;
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (pos[i] < '0' || pos[i] > '9') {
+			return HPERR_MALFORMED_HEADER;
+		}
+		status = status * 10 + pos[i] - '0';
+	}
+
+	/* exactly 3 digits */
+	if (pos + 3 < in_end && pos[3] != ' ' && pos[3] != '\r' && pos[3] != '\n') {
+		return HPERR_MALFORMED_HEADER;
+	}
+
+	/* skip the reason phrase */
+	const char *eol = memchr(pos, '\n', in_end - pos);
+	*in_pos_p = (eol != NULL) ? eol + 1 : in_end;
+	return status;
+}
+
+int hpack_encode_http1(hpack_t *hpack, const char *in_buf, const char *in_end,
+		uint8_t *out_buf, uint8_t *out_end)
+{
+	const char *in_pos = in_buf;
+	int status = hpack_http1_parse_status(&in_pos, in_end);
+	if (status < 0) {
+		return status;
+	}
+	const char *headers_pos = in_pos;
+
+	/* find Connection headers first, which may be after their options */
+	struct hpack_http1_connection conn;
+	conn.count = 0;
+	struct hpack_header h;
+	int ret;
+	while ((ret = hpack_http1_parse_line(&in_pos, in_end, &h)) > 0) {
+		if (conn.count < HPACK_HTTP1_CONNECTION_MAX
+				&& hpack_http1_name_is(h.name_str, h.name_len, "connection", 10)) {
+			conn.values[conn.count] = h.value_str;
+			conn.value_lens[conn.count] = h.value_len;
+			conn.count++;
+		}
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* pending size update must go before :status */
+	uint8_t *out_pos = out_buf;
+	ret = hpack_encode_size_update(hpack, out_pos, out_end);
+	if (ret < 0) {
+		return ret;
+	}
+	out_pos += ret;
+
+	ret = hpack_encode_status(status, out_pos, out_end);
+	if (ret < 0) {
+		return ret;
+	}
+	out_pos += ret;
+
+	in_pos = headers_pos;
+	while ((ret = hpack_http1_parse_line(&in_pos, in_end, &h)) > 0) {
+		if (hpack_http1_is_hop(&conn, h.name_str, h.name_len)) {
+			continue;
+		}
+		ret = hpack_encode_header(hpack, h.name_str, h.name_len,
+				h.value_str, h.value_len, out_pos, out_end);
+		if (ret < 0) {
+			return ret;
+		}
+		out_pos += ret;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	return out_pos - out_buf;
+}
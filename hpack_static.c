@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "hpack.h"
 #include "hpack_static.h"
 
 struct hpack_static_entry {
@@ -79,12 +80,10 @@ static struct hpack_static_entry hpack_static_table[] =
 	STE_NAME_ONLY("www-authenticate"),
 };
 
-#define HPACK_STATIC_TABLE_SIZE (sizeof(hpack_static_table) / sizeof(struct hpack_static_entry))
-
 bool hpack_static_decode(int index, const char **name_str, int *name_len,
 		const char **value_str, int *value_len)
 {
-	if (index < 1 || index >= HPACK_STATIC_TABLE_SIZE) {
+	if (index < 1 || index > HPACK_STATIC_TABLE_SIZE) {
 		return false;
 	}
 
@@ -92,7 +91,8 @@ bool hpack_static_decode(int index, const char **name_str, int *name_len,
 	*name_str = se->name_str;
 	*name_len = se->name_len;
 	if (value_str != NULL) {
-		*value_str = se->value_str;
+		/* name-only entries have no value string */
+		*value_str = se->value_str ? se->value_str : "";
 		*value_len = se->value_len;
 	}
 	return true;
@@ -111,11 +111,15 @@ static int hpack_static_hash_buckets[244] = {
 };
 static int hpack_static_hash(const char *str, int len)
 {
-	return (str[0]*29*131 + str[len-1]*131 + len) % 244;
+	/* unsigned, or bytes >= 0x80 make negative buckets */
+	return ((uint8_t)str[0]*29*131 + (uint8_t)str[len-1]*131 + len) % 244;
 }
 
 int hpack_static_encode_name(const char *name_str, int name_len)
 {
+	if (name_len == 0) {
+		return -1;
+	}
 	int hash = hpack_static_hash(name_str, name_len);
 	int index = hpack_static_hash_buckets[hash];
 	if (index == 0) {
@@ -124,3 +128,71 @@ int hpack_static_encode_name(const char *name_str, int name_len)
 	struct hpack_static_entry *e = &hpack_static_table[index];
 	return name_len == e->name_len && memcmp(e->name_str, name_str, name_len) == 0 ? index : -1;
 }
+
+/* Return the index if both name and value match, or 0 and set
+ * @name_index if only name matches, or 0 if none.
+ * Entries with the same name are adjacent, and the perfect hash
+ * points to the first of them. */
+int hpack_static_encode(const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index)
+{
+	int index = hpack_static_encode_name(name_str, name_len);
+	if (index < 0) {
+		*name_index = 0;
+		return 0;
+	}
+	*name_index = index;
+
+	int i;
+	for (i = index; i <= HPACK_STATIC_TABLE_SIZE; i++) {
+		struct hpack_static_entry *e = &hpack_static_table[i];
+		if (i != index && (e->name_len != name_len
+				|| memcmp(e->name_str, name_str, name_len) != 0)) {
+			break;
+		}
+		if (e->value_len == value_len && (value_len == 0
+				|| memcmp(e->value_str, value_str, value_len) == 0)) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+/* token of each entry, the index of the first entry with the same name */
+static const unsigned char hpack_static_tokens[HPACK_STATIC_TABLE_SIZE + 1] = {
+	0, 1, 2, 2, 4, 4, 6, 6, 8, 8, 8, 8, 8, 8, 8, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+	48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
+};
+
+int hpack_static_token(int index)
+{
+	return hpack_static_tokens[index];
+}
+
+static const struct {
+	const char	*name_str;
+	int		name_len;
+} hpack_token_extended[] = {
+#define HPACK_TOKEN_X(id, name) { name, sizeof(name)-1 },
+	HPACK_TOKEN_EXTENDED(HPACK_TOKEN_X)
+#undef HPACK_TOKEN_X
+};
+
+int hpack_name_token(const char *name_str, int name_len)
+{
+	int index = hpack_static_encode_name(name_str, name_len);
+	if (index > 0) {
+		return index;
+	}
+
+	int i;
+	for (i = 0; i < HPACK_TOKEN_MAX - HPACK_STATIC_TABLE_SIZE - 1; i++) {
+		if (hpack_token_extended[i].name_len == name_len
+				&& memcmp(hpack_token_extended[i].name_str, name_str, name_len) == 0) {
+			return HPACK_STATIC_TABLE_SIZE + 1 + i;
+		}
+	}
+	return HPACK_TOKEN_UNKNOWN;
+}
@@ -3,9 +3,17 @@
 
 #include <stdbool.h>
 
+#define HPACK_STATIC_TABLE_SIZE		61
+
 bool hpack_static_decode(int index, const char **name_str, int *name_len,
 		const char **value_str, int *value_len);
 
+/* the token of a valid index */
+int hpack_static_token(int index);
+
 int hpack_static_encode_name(const char *name_str, int name_len);
 
+int hpack_static_encode(const char *name_str, int name_len,
+		const char *value_str, int value_len, int *name_index);
+
 #endif
@@ -3,42 +3,173 @@
 #include "huffman_table.h"
 #include "huffman.h"
 
-static char *huffdecode4(char *dst, uint8_t in, uint8_t *state, int *maybe_eos)
+#ifdef HUFFMAN_DECODE_BYTE
+
+#include "huffman_table8.h"
+
+/* byte-at-a-time decoding, emitting up to 2 symbols per lookup */
+int huffman_decoder_feed(struct huffman_decoder *hd,
+		const uint8_t **in_pos_p, const uint8_t *in_end,
+		char *out_buf, int out_len)
 {
-	const nghttp2_huff_decode *entry = huff_decode_table[*state] + in;
+	const uint8_t *in_pos = *in_pos_p;
+	char *out_pos = out_buf;
+	char *out_end = out_buf + out_len;
+	uint8_t state = hd->state;
+	bool accept = hd->accept;
 
-	if ((entry->flags & NGHTTP2_HUFF_FAIL) != 0)
-		return NULL;
-	if ((entry->flags & NGHTTP2_HUFF_SYM) != 0)
-		*dst++ = entry->sym;
-	*state = entry->state;
-	*maybe_eos = (entry->flags & NGHTTP2_HUFF_ACCEPTED) != 0;
+	while (in_pos < in_end) {
+		const struct huffman_decode8 *entry = &huff_decode_table8[state][*in_pos];
+		if ((entry->flags & HUFF8_FAIL) != 0)
+			return -1;
+
+		int nsym = HUFF8_NSYM(entry->flags);
+		if (nsym > out_end - out_pos)
+			break;
+		if (nsym > 0)
+			out_pos[0] = entry->sym[0];
+		if (nsym > 1)
+			out_pos[1] = entry->sym[1];
+		out_pos += nsym;
+
+		state = entry->state;
+		accept = (entry->flags & HUFF8_ACCEPTED) != 0;
+		in_pos++;
+	}
 
-	return dst;
+	hd->state = state;
+	hd->accept = accept;
+	*in_pos_p = in_pos;
+	return out_pos - out_buf;
 }
 
-int huffman_decode(const uint8_t *in_buf, int in_len, char *out_buf, int out_len)
+#else
+
+/* 4-bit FSA decoding, two lookups per byte */
+int huffman_decoder_feed(struct huffman_decoder *hd,
+		const uint8_t **in_pos_p, const uint8_t *in_end,
+		char *out_buf, int out_len)
 {
+	const uint8_t *in_pos = *in_pos_p;
 	char *out_pos = out_buf;
-	uint8_t state = 0;
-	int maybe_eos = 1;
+	char *out_end = out_buf + out_len;
+	uint8_t state = hd->state;
+	bool accept = hd->accept;
+
+	while (in_pos < in_end) {
+		const nghttp2_huff_decode *hi = huff_decode_table[state] + (*in_pos >> 4);
+		const nghttp2_huff_decode *lo = huff_decode_table[hi->state] + (*in_pos & 0xf);
+		if (((hi->flags | lo->flags) & NGHTTP2_HUFF_FAIL) != 0)
+			return -1;
+
+		int nsym = ((hi->flags & NGHTTP2_HUFF_SYM) != 0)
+				+ ((lo->flags & NGHTTP2_HUFF_SYM) != 0);
+		if (nsym > out_end - out_pos)
+			break;
+		if ((hi->flags & NGHTTP2_HUFF_SYM) != 0)
+			*out_pos++ = hi->sym;
+		if ((lo->flags & NGHTTP2_HUFF_SYM) != 0)
+			*out_pos++ = lo->sym;
+
+		state = lo->state;
+		accept = (lo->flags & NGHTTP2_HUFF_ACCEPTED) != 0;
+		in_pos++;
+	}
+
+	hd->state = state;
+	hd->accept = accept;
+	*in_pos_p = in_pos;
+	return out_pos - out_buf;
+}
+
+#endif
+
+void huffman_decoder_init(struct huffman_decoder *hd)
+{
+	hd->state = 0;
+	hd->accept = true;
+}
+
+bool huffman_decoder_finish(struct huffman_decoder *hd)
+{
+	return hd->accept;
+}
+
+int huffman_decode(const uint8_t *in_buf, int in_len, char *out_buf, int out_len)
+{
+	struct huffman_decoder hd;
+	huffman_decoder_init(&hd);
+
+	/* keep one byte for the terminating '\0' */
+	const uint8_t *in_pos = in_buf;
+	int len = huffman_decoder_feed(&hd, &in_pos, in_buf + in_len,
+			out_buf, out_len - 1);
+	if (len < 0 || in_pos != in_buf + in_len || !huffman_decoder_finish(&hd))
+		return -1;
+
+	out_buf[len] = '\0';
+	return len;
+}
+
+int huffman_encoded_len(const char *in_buf, int in_len)
+{
+	const uint8_t *p = (const uint8_t *)in_buf;
+	size_t nbits = 0;
 
 	int i;
 	for (i = 0; i < in_len; i++) {
-		uint8_t ch = in_buf[i];
-		if ((out_pos = huffdecode4(out_pos, ch >> 4, &state, &maybe_eos)) == NULL)
-			return -1;
-		if ((out_pos = huffdecode4(out_pos, ch & 0xf, &state, &maybe_eos)) == NULL)
-			return -1;
+		nbits += huff_sym_table[p[i]].nbits;
+	}
+	return (nbits + 7) / 8;
+}
 
-		if (out_pos - out_buf >= out_len) {
-			return -1;
+static uint8_t *huffman_flush32(uint8_t *out_pos, uint64_t bits, int nbits)
+{
+	uint32_t word = bits >> (nbits - 32);
+	out_pos[0] = word >> 24;
+	out_pos[1] = word >> 16;
+	out_pos[2] = word >> 8;
+	out_pos[3] = word;
+	return out_pos + 4;
+}
+
+int huffman_encode(const char *in_buf, int in_len, uint8_t *out_buf, int out_len)
+{
+	const uint8_t *p = (const uint8_t *)in_buf;
+	uint8_t *out_pos = out_buf;
+	uint8_t *out_end = out_buf + out_len;
+
+	/* at most 31 pending bits, plus a 30-bit code, fit in 64 bits */
+	uint64_t bits = 0;
+	int nbits = 0;
+
+	int i;
+	for (i = 0; i < in_len; i++) {
+		const nghttp2_huff_sym *sym = &huff_sym_table[p[i]];
+		bits = (bits << sym->nbits) | sym->code;
+		nbits += sym->nbits;
+
+		if (nbits >= 32) {
+			if (out_end - out_pos < 4) {
+				return -1;
+			}
+			out_pos = huffman_flush32(out_pos, bits, nbits);
+			nbits -= 32;
 		}
 	}
 
-	if (!maybe_eos)
+	/* pad with the most-significant bits of EOS, which are all 1 */
+	int pad = (8 - nbits % 8) % 8;
+	bits = (bits << pad) | ((1 << pad) - 1);
+	nbits += pad;
+
+	if (out_end - out_pos < nbits / 8) {
 		return -1;
+	}
+	while (nbits > 0) {
+		nbits -= 8;
+		*out_pos++ = bits >> nbits;
+	}
 
-	*out_pos = '\0';
 	return out_pos - out_buf;
 }
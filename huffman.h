@@ -2,7 +2,32 @@
 #define HUFFMAN_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+/* the shortest code is 5 bits */
+#define HUFFMAN_DECODED_MAX_LEN(in_len)	((in_len) * 8 / 5)
+
+/* resumable decoder, for input in fragments */
+struct huffman_decoder {
+	uint8_t		state;
+	bool		accept;
+};
+
+void huffman_decoder_init(struct huffman_decoder *hd);
+
+/* Decode from *in_pos_p, advancing it, until input ends or out_buf is full.
+ * Return output length, or -1 if invalid. */
+int huffman_decoder_feed(struct huffman_decoder *hd,
+		const uint8_t **in_pos_p, const uint8_t *in_end,
+		char *out_buf, int out_len);
+
+/* Return true if the whole input ends at a valid padding. */
+bool huffman_decoder_finish(struct huffman_decoder *hd);
 
 int huffman_decode(const uint8_t *in_buf, int in_len, char *out_buf, int out_len);
 
+int huffman_encoded_len(const char *in_buf, int in_len);
+
+int huffman_encode(const char *in_buf, int in_len, uint8_t *out_buf, int out_len);
+
 #endif
@@ -0,0 +1,64 @@
+/*
+ * Generate huffman_table8.h, the byte-at-a-time huffman decode table,
+ * from the 4-bit FSA table in huffman_table.h.
+ *
+ * Each entry consumes a whole input byte, which is two steps of the
+ * 4-bit FSA, and so emits at most 2 symbols: the shortest code is 5
+ * bits, so a byte can finish one pending code and hold one whole code.
+ *
+ * The table is 256 states x 256 bytes x 4 bytes = 256 KiB.
+ */
+
+#include <stdio.h>
+
+#include "huffman_table.h"
+
+#define HUFF8_ACCEPTED	0x01
+#define HUFF8_FAIL	0x02
+
+int main(void)
+{
+	printf("/* generated by huffman_gen8.c, do not edit */\n\n");
+	printf("#include <stdint.h>\n\n");
+	printf("#define HUFF8_ACCEPTED\t0x%02x\n", HUFF8_ACCEPTED);
+	printf("#define HUFF8_FAIL\t0x%02x\n", HUFF8_FAIL);
+	printf("#define HUFF8_NSYM(flags)\t((flags) >> 2)\n\n");
+	printf("struct huffman_decode8 {\n");
+	printf("\tuint8_t\t\tstate;\n");
+	printf("\tuint8_t\t\tflags;\n");
+	printf("\tuint8_t\t\tsym[2];\n");
+	printf("};\n\n");
+	printf("static const struct huffman_decode8 huff_decode_table8[256][256] = {\n");
+
+	int state, byte;
+	for (state = 0; state < 256; state++) {
+		printf("\t/* %d */\n\t{\n", state);
+		for (byte = 0; byte < 256; byte++) {
+			const nghttp2_huff_decode *hi = &huff_decode_table[state][byte >> 4];
+			const nghttp2_huff_decode *lo = &huff_decode_table[hi->state][byte & 0xf];
+
+			int flags = 0, nsym = 0;
+			int sym[2] = { 0, 0 };
+			if ((hi->flags & NGHTTP2_HUFF_FAIL) || (lo->flags & NGHTTP2_HUFF_FAIL)) {
+				printf("\t\t{0, 0x%02x, {0, 0}},\n", HUFF8_FAIL);
+				continue;
+			}
+			if (hi->flags & NGHTTP2_HUFF_SYM) {
+				sym[nsym++] = hi->sym;
+			}
+			if (lo->flags & NGHTTP2_HUFF_SYM) {
+				sym[nsym++] = lo->sym;
+			}
+			if (lo->flags & NGHTTP2_HUFF_ACCEPTED) {
+				flags |= HUFF8_ACCEPTED;
+			}
+			flags |= nsym << 2;
+
+			printf("\t\t{%d, 0x%02x, {%d, %d}},\n", lo->state, flags, sym[0], sym[1]);
+		}
+		printf("\t},\n");
+	}
+
+	printf("};\n");
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Test of hpack_decode_http1().
+ *
+ * Each case encodes a request header block, decodes it into HTTP/1.1 and
+ * checks the result. After a failed case, a block referring to its last
+ * header checks that the decoder table is still in sync.
+ *
+ * Usage: test_http1
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hpack.h"
+
+#define TEST_HEADERS_MAX	8
+
+struct test_case {
+	const char	*title;
+	const char	*headers[TEST_HEADERS_MAX * 2];
+	int		out_size;
+	int		ret;		/* expected error, or 0 */
+	const char	*output;	/* expected output if OK */
+};
+
+static const struct test_case test_cases[] = {
+	{ "request",
+		{ ":method", "GET", ":path", "/a", ":authority", "example.com", "x-a", "1" },
+		1024, 0, "GET /a HTTP/1.1\r\nHost: example.com\r\nx-a: 1\r\n" },
+	{ "connect",
+		{ ":method", "CONNECT", ":authority", "example.com:443" },
+		1024, 0, "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com:443\r\n" },
+	{ "no space",
+		{ ":method", "GET", ":path", "/a", "x-a", "1", "x-b", "22", "x-c", "333" },
+		20, HPERR_NO_SPACE },
+	{ "space in path",
+		{ ":method", "GET", ":path", "/a HTTP/1.0 x", "x-d", "4" },
+		1024, HPERR_MALFORMED_HEADER },
+	{ "tab in path",
+		{ ":method", "GET", ":path", "/a\tb", "x-e", "5" },
+		1024, HPERR_MALFORMED_HEADER },
+	{ "empty path",
+		{ ":method", "GET", ":path", "", "x-f", "6" },
+		1024, HPERR_MALFORMED_HEADER },
+	{ "space in method",
+		{ ":method", "GET /x", ":path", "/a", "x-g", "7" },
+		1024, HPERR_MALFORMED_HEADER },
+	{ "space in authority-form",
+		{ ":method", "CONNECT", ":authority", "a b:443", "x-h", "8" },
+		1024, HPERR_MALFORMED_HEADER },
+};
+
+static int test_headers(const struct test_case *tc, struct hpack_header *headers)
+{
+	int count;
+	for (count = 0; count < TEST_HEADERS_MAX && tc->headers[count * 2] != NULL; count++) {
+		struct hpack_header *h = &headers[count];
+		memset(h, 0, sizeof(struct hpack_header));
+		h->name_str = tc->headers[count * 2];
+		h->name_len = strlen(h->name_str);
+		h->value_str = tc->headers[count * 2 + 1];
+		h->value_len = strlen(h->value_str);
+	}
+	return count;
+}
+
+static int test_run(hpack_t *encoder, hpack_t *decoder, const struct test_case *tc)
+{
+	struct hpack_header headers[TEST_HEADERS_MAX];
+	uint8_t block[1024];
+	char out[1024];
+
+	int count = test_headers(tc, headers);
+	int len = hpack_encode_block(encoder, headers, count, block, block + sizeof(block));
+	if (len < 0) {
+		fprintf(stderr, "%s: encode: %s\n", tc->title, hpack_strerror(len));
+		return 1;
+	}
+
+	int ret = hpack_decode_http1(decoder, block, block + len, 0, out, out + tc->out_size);
+	if (tc->ret != 0) {
+		if (ret != tc->ret) {
+			fprintf(stderr, "%s: got %d, expected %s\n", tc->title, ret,
+					hpack_strerror(tc->ret));
+			return 1;
+		}
+	} else if (ret < 0) {
+		fprintf(stderr, "%s: decode: %s\n", tc->title, hpack_strerror(ret));
+		return 1;
+	} else if (ret != strlen(tc->output) || memcmp(out, tc->output, ret) != 0) {
+		fprintf(stderr, "%s: got \"%.*s\"\n", tc->title, ret, out);
+		return 1;
+	}
+
+	/* the request, and the last header of the case, which is indexed now
+	 * and so refers to the decoder table */
+	if (tc->ret == 0) {
+		return 0;
+	}
+	const struct test_case *ok = &test_cases[0];
+	struct hpack_header last = headers[count - 1];
+	count = test_headers(ok, headers);
+	headers[count++] = last;
+	len = hpack_encode_block(encoder, headers, count, block, block + sizeof(block));
+
+	char expected[1024];
+	int expected_len = snprintf(expected, sizeof(expected), "%s%.*s: %.*s\r\n",
+			ok->output, last.name_len, last.name_str, last.value_len, last.value_str);
+	ret = hpack_decode_http1(decoder, block, block + len, 0, out, out + sizeof(out));
+	if (ret != expected_len || memcmp(out, expected, ret) != 0) {
+		fprintf(stderr, "%s: out of sync: %s\n", tc->title,
+				ret < 0 ? hpack_strerror(ret) : "mismatch");
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	hpack_t *encoder = hpack_new(4096);
+	hpack_t *decoder = hpack_new(4096);
+	int i, failed = 0;
+
+	for (i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+		failed |= test_run(encoder, decoder, &test_cases[i]);
+	}
+
+	printf("test_http1: %d cases: %s\n", i, failed ? "FAIL" : "OK");
+	hpack_free(encoder);
+	hpack_free(decoder);
+	return failed;
+}
@@ -0,0 +1,143 @@
+/*
+ * Multi-threaded round-trip test.
+ *
+ * Each thread encodes and decodes header blocks with its own pair of
+ * contexts, including Huffman-coded values longer than 4 KiB, and checks
+ * the decoded headers. Decoding must not share any state between
+ * contexts, so the threads run without locking.
+ *
+ * Usage: test_threads [threads] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hpack.h"
+
+#define TEST_HEADERS		8
+#define TEST_VALUE_MAX		6000
+
+struct test_thread {
+	pthread_t	tid;
+	int		id;
+	int		rounds;
+	int		failed;
+};
+
+struct test_check {
+	const struct hpack_header *headers;
+	int		count;
+	int		index;
+	bool		mismatch;
+};
+
+static int test_check_handler(void *data, const struct hpack_header *header)
+{
+	struct test_check *check = data;
+	if (check->index >= check->count) {
+		check->mismatch = true;
+		return 0;
+	}
+	const struct hpack_header *h = &check->headers[check->index++];
+	if (header->name_len != h->name_len || header->value_len != h->value_len
+			|| memcmp(header->name_str, h->name_str, h->name_len) != 0
+			|| memcmp(header->value_str, h->value_str, h->value_len) != 0) {
+		check->mismatch = true;
+	}
+	return 0;
+}
+
+static void *test_thread_run(void *arg)
+{
+	struct test_thread *t = arg;
+	static const char *names[] = { "cookie", "x-trace", "user-agent", "x-big" };
+	char names_buf[TEST_HEADERS][16];
+	char values[TEST_HEADERS][TEST_VALUE_MAX];
+	struct hpack_header headers[TEST_HEADERS];
+	uint8_t out[TEST_HEADERS * TEST_VALUE_MAX * 2];
+	unsigned int seed = t->id;
+	int round, i;
+
+	hpack_t *encoder = hpack_new(4096);
+	hpack_t *decoder = hpack_new(4096);
+
+	for (round = 0; round < t->rounds; round++) {
+		int count = 1 + rand_r(&seed) % TEST_HEADERS;
+		for (i = 0; i < count; i++) {
+			struct hpack_header *h = &headers[i];
+			memset(h, 0, sizeof(struct hpack_header));
+
+			/* some repeated headers for the dynamic table */
+			if (rand_r(&seed) % 2) {
+				h->name_str = names[rand_r(&seed) % 4];
+				h->name_len = strlen(h->name_str);
+			} else {
+				h->name_len = sprintf(names_buf[i], "x-%d-%d", t->id, rand_r(&seed) % 50);
+				h->name_str = names_buf[i];
+			}
+
+			/* long values, over 4 KiB, in 1 of 4 */
+			int len = rand_r(&seed) % 4 == 0
+					? 4097 + rand_r(&seed) % (TEST_VALUE_MAX - 4097)
+					: rand_r(&seed) % 100;
+			int j;
+			for (j = 0; j < len; j++) {
+				values[i][j] = 'a' + (j * 7 + t->id + round) % 26;
+			}
+			h->value_str = values[i];
+			h->value_len = len;
+		}
+
+		int len = hpack_encode_block(encoder, headers, count, out, out + sizeof(out));
+		if (len < 0) {
+			fprintf(stderr, "thread %d: encode: %s\n", t->id, hpack_strerror(len));
+			t->failed = 1;
+			break;
+		}
+
+		struct test_check check = {
+			.headers = headers,
+			.count = count,
+		};
+		int ret = hpack_decode_block(decoder, out, out + len, 0,
+				test_check_handler, &check);
+		if (ret < 0 || check.mismatch || check.index != count) {
+			fprintf(stderr, "thread %d: decode round %d: %s\n", t->id, round,
+					ret < 0 ? hpack_strerror(ret) : "mismatch");
+			t->failed = 1;
+			break;
+		}
+	}
+
+	hpack_free(encoder);
+	hpack_free(decoder);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int thread_count = argc > 1 ? atoi(argv[1]) : 8;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5000;
+	struct test_thread *threads = calloc(thread_count, sizeof(struct test_thread));
+	int i, failed = 0;
+
+	for (i = 0; i < thread_count; i++) {
+		threads[i].id = i;
+		threads[i].rounds = rounds;
+		if (pthread_create(&threads[i].tid, NULL, test_thread_run, &threads[i]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < thread_count; i++) {
+		pthread_join(threads[i].tid, NULL);
+		failed |= threads[i].failed;
+	}
+
+	printf("test_threads: %d threads, %d rounds: %s\n", thread_count, rounds,
+			failed ? "FAIL" : "OK");
+	free(threads);
+	return failed;
+}